@@ -23,6 +23,13 @@
  */
 #include "py/dynruntime.h"
 #include "cbor.h"
+#include "cborjson.h"
+
+#include <stdarg.h>
+
+// exception types that dynruntime.h doesn't provide
+#define mp_type_MemoryError (*(mp_obj_type_t *)(mp_load_global(MP_QSTR_MemoryError)))
+#define mp_type_OSError (*(mp_obj_type_t *)(mp_load_global(MP_QSTR_OSError)))
 
 // Automatically detect if this module should include double-precision code.
 // If double precision is supported by the target architecture then it can
@@ -87,7 +94,158 @@ void free(void *ptr) {
     m_free(ptr);
 }
 
-STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj) {
+// Every level of nesting costs C stack, so loads() goes no deeper than tinycbor's own walkers, which the Makefile
+// limits to what small targets can afford. max_depth can only lower it.
+#ifndef CBOR_PARSER_MAX_RECURSIONS
+#define CBOR_PARSER_MAX_RECURSIONS (1024)
+#endif
+#define DEFAULT_MAX_DEPTH (CBOR_PARSER_MAX_RECURSIONS)
+
+typedef struct _decode_ctx_t {
+    // strict decoding rejects invalid UTF-8 in text strings and duplicate map keys as they are materialized, so
+    // untrusted input doesn't need a separate validation pass
+    bool strict;
+
+    // limits on untrusted input, SIZE_MAX when unlimited. Declared lengths are checked against them, and against
+    // the bytes left in the buffer, before anything is allocated for an item.
+    size_t max_depth;
+    size_t max_items;
+    size_t max_string_len;
+    size_t max_total_alloc;
+
+    // what the decode has used so far
+    const uint8_t *end;
+    size_t depth;
+    size_t items;
+    size_t total_alloc;
+} decode_ctx_t;
+
+STATIC void decode_ctx_init(decode_ctx_t *ctx, const mp_buffer_info_t *bufinfo) {
+    ctx->strict = false;
+    ctx->max_depth = DEFAULT_MAX_DEPTH;
+    ctx->max_items = SIZE_MAX;
+    ctx->max_string_len = SIZE_MAX;
+    ctx->max_total_alloc = SIZE_MAX;
+    ctx->end = (const uint8_t *)bufinfo->buf + bufinfo->len;
+    ctx->depth = 0;
+    ctx->items = 0;
+    ctx->total_alloc = 0;
+}
+
+// Accounts for n bytes of heap about to be allocated for the decoded objects.
+STATIC void decode_ctx_charge(decode_ctx_t *ctx, size_t n) {
+    if (n > ctx->max_total_alloc - ctx->total_alloc) {
+        mp_raise_ValueError("allocation limit exceeded");
+    }
+    ctx->total_alloc += n;
+}
+
+STATIC void decode_check_string(decode_ctx_t *ctx, const CborValue *it) {
+    size_t len;
+    CborError err = cbor_value_get_string_length(it, &len);
+    if (err == CborErrorUnknownLength) {
+        // a chunked string: adding up the chunk headers doesn't allocate anything
+        err = cbor_value_calculate_string_length(it, &len);
+    } else if (err == CborNoError && len > (size_t)(ctx->end - cbor_value_get_next_byte(it))) {
+        err = CborErrorUnexpectedEOF;
+    }
+    if (err) {
+        mp_raise_ValueError("declared length exceeds data");
+    }
+    if (len > ctx->max_string_len) {
+        mp_raise_ValueError("string too long");
+    }
+    decode_ctx_charge(ctx, len);
+}
+
+STATIC void decode_check_container(decode_ctx_t *ctx, const CborValue *it, CborType type) {
+    if (ctx->depth == ctx->max_depth) {
+        mp_raise_ValueError("nesting too deep");
+    }
+
+    size_t n;
+    CborError err = type == CborArrayType ? cbor_value_get_array_length(it, &n) : cbor_value_get_map_length(it, &n);
+    if (err == CborErrorUnknownLength) {
+        // nothing declared, the items are counted as they are decoded
+        return;
+    }
+    if (err == CborNoError && type == CborMapType) {
+        err = n > SIZE_MAX / 2 ? CborErrorDataTooLarge : CborNoError;
+        n *= 2;
+    }
+    // every item takes at least one byte
+    if (err || n > (size_t)(ctx->end - cbor_value_get_next_byte(it))) {
+        mp_raise_ValueError("declared length exceeds data");
+    }
+    if (n > ctx->max_items - ctx->items) {
+        mp_raise_ValueError("too many items");
+    }
+    if (n > (ctx->max_total_alloc - ctx->total_alloc) / sizeof(mp_obj_t)) {
+        mp_raise_ValueError("allocation limit exceeded");
+    }
+}
+
+// int.from_bytes(buf, "big")
+STATIC mp_obj_t int_from_be_bytes(const uint8_t *buf, size_t len) {
+    mp_obj_t dest[4];
+    mp_load_method(MP_OBJ_FROM_PTR(&mp_type_int), MP_QSTR_from_bytes, dest);
+    dest[2] = mp_obj_new_bytes(buf, len);
+    dest[3] = MP_OBJ_NEW_QSTR(MP_QSTR_big);
+    return mp_call_method_n_kw(2, 0, dest);
+}
+
+// Integers are decoded over their full range: CBOR negative integers are -1 - n for an unsigned 64-bit n, and
+// whatever doesn't fit in a machine word goes through a big int.
+STATIC mp_obj_t decode_int(const CborValue *it) {
+    uint64_t n;
+    cbor_value_get_raw_integer(it, &n);
+    bool negative = cbor_value_is_negative_integer(it);
+
+    if (n <= MP_SMALL_INT_MAX) {
+        return MP_OBJ_NEW_SMALL_INT(negative ? -1 - (mp_int_t)n : (mp_int_t)n);
+    }
+    if (!negative && n <= (mp_uint_t)-1) {
+        return mp_obj_new_int_from_uint((mp_uint_t)n);
+    }
+    if (negative && n <= (mp_uint_t)-1 >> 1) {
+        return mp_obj_new_int(-1 - (mp_int_t)n);
+    }
+
+    uint8_t buf[8];
+    for (int i = 7; i >= 0; i--) {
+        buf[i] = (uint8_t)n;
+        n >>= 8;
+    }
+    mp_obj_t result = int_from_be_bytes(buf, sizeof(buf));
+    return negative ? mp_unary_op(MP_UNARY_OP_INVERT, result) : result;
+}
+
+// The byte string of a bignum tag (2 or 3), whose contents are the big-endian magnitude.
+STATIC mp_obj_t decode_bignum(decode_ctx_t *ctx, CborValue *it, bool negative) {
+    mp_obj_t result;
+    const uint8_t *span;
+    size_t n;
+
+    decode_check_string(ctx, it);
+    CborError err = cbor_value_get_byte_string_span(it, &span, &n, it);
+    if (err == CborErrorUnknownLength) {
+        uint8_t *buf;
+        err = cbor_value_dup_byte_string(it, &buf, &n, it);
+        if (err)
+            mp_raise_ValueError("parse bytestring failed");
+        result = int_from_be_bytes(buf, n);
+        m_free(buf);
+    } else if (err) {
+        mp_raise_ValueError("parse bytestring failed");
+    } else {
+        result = int_from_be_bytes(span, n);
+    }
+
+    // a negative bignum holds -1 - n
+    return negative ? mp_unary_op(MP_UNARY_OP_INVERT, result) : result;
+}
+
+STATIC mp_obj_t cbor_it_to_mp_obj_recursive(decode_ctx_t *ctx, CborValue *it, mp_obj_t parent_obj) {
     bool dict_value_next = false;
     mp_obj_t dict_key = mp_const_none;
     CborError err;
@@ -101,29 +259,70 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
 
         mp_obj_t next_element = mp_const_none;
 
+        if (ctx->items == ctx->max_items) {
+            mp_raise_ValueError("too many items");
+        }
+        ctx->items++;
+        if (parent_obj != mp_const_none) {
+            // the slot the item takes in its list or dict
+            decode_ctx_charge(ctx, sizeof(mp_obj_t));
+        }
+
         if (type == CborIntegerType){
-            int64_t val;
-            cbor_value_get_int64(it, &val);
-            next_element = mp_obj_new_int(val);
+            next_element = decode_int(it);
         } else if(type == CborByteStringType) {
-            uint8_t *buf;
+            // strings of known length are built straight from the input buffer, only chunked ones are coalesced
+            const uint8_t *span;
             size_t n;
-            err = cbor_value_dup_byte_string(it, &buf, &n, it);
-            if (err)
+            decode_check_string(ctx, it);
+            err = cbor_value_get_byte_string_span(it, &span, &n, it);
+            if (err == CborErrorUnknownLength) {
+                uint8_t *buf;
+                err = cbor_value_dup_byte_string(it, &buf, &n, it);
+                if (err)
+                    mp_raise_ValueError("parse bytestring failed");
+                next_element = mp_obj_new_bytes(buf, n);
+                m_free(buf);
+            } else if (err) {
                 mp_raise_ValueError("parse bytestring failed");
-            next_element = mp_obj_new_bytes(buf, n);
-            m_free(buf);
+            } else {
+                next_element = mp_obj_new_bytes(span, n);
+            }
         } else if (type == CborTextStringType){
-            char *buf;
+            const char *span;
             size_t n;
-            err = cbor_value_dup_text_string(it, &buf, &n, it);
-            if (err)
+            decode_check_string(ctx, it);
+            err = cbor_value_get_text_string_span(it, &span, &n, it);
+            if (err == CborErrorUnknownLength) {
+                // chunks are checked once joined, so a character split across two of them isn't rejected
+                char *buf;
+                err = cbor_value_dup_text_string(it, &buf, &n, it);
+                if (err)
+                    mp_raise_ValueError("parse string failed");
+                if (ctx->strict && cbor_validate_utf8(buf, n) != CborNoError) {
+                    m_free(buf);
+                    mp_raise_ValueError("invalid UTF-8 in string");
+                }
+                next_element = mp_obj_new_str(buf, n);
+                m_free(buf);
+            } else if (err) {
                 mp_raise_ValueError("parse string failed");
-            next_element = mp_obj_new_str(buf, n);
-            m_free(buf);
-
+            } else {
+                if (ctx->strict && cbor_validate_utf8(span, n) != CborNoError)
+                    mp_raise_ValueError("invalid UTF-8 in string");
+                next_element = mp_obj_new_str(span, n);
+            }
         } else if (type == CborTagType) {
-            mp_raise_ValueError("unknown tag present");
+            CborTag tag;
+            cbor_value_get_tag(it, &tag);
+            if (tag != CborPositiveBignumTag && tag != CborNegativeBignumTag) {
+                mp_raise_ValueError("unknown tag present");
+            }
+            err = cbor_value_advance_fixed(it);
+            if (err || !cbor_value_is_byte_string(it)) {
+                mp_raise_ValueError("bignum must be a byte string");
+            }
+            next_element = decode_bignum(ctx, it, tag == CborNegativeBignumTag);
         } else if (type == CborSimpleType) {
             mp_raise_ValueError("unknown simple value present");
         } else if (type == CborNullType) {
@@ -142,13 +341,16 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
             float val;
             cbor_value_get_float(it, &val);
             next_element = mp_obj_new_float_from_f(val);
-        } else if (type == CborHalfFloatType ){
-            mp_raise_NotImplementedError("half float type not supported");
+        } else if (type == CborHalfFloatType) {
+            float val;
+            cbor_value_get_half_float_as_float(it, &val);
+            next_element = mp_obj_new_float_from_f(val);
         } else if (type == CborInvalidType) {
             mp_raise_ValueError("invalid type encountered");
         } else if (type == CborArrayType || type == CborMapType) {
             CborValue recursed;
             assert(cbor_value_is_container(it));
+            decode_check_container(ctx, it, type);
             err = cbor_value_enter_container(it, &recursed);
             if (err)
                 mp_raise_ValueError("parse error");
@@ -159,7 +361,9 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
                 next_element = mp_obj_new_dict(0);
             }
 
-            cbor_it_to_mp_obj_recursive(&recursed, next_element);
+            ctx->depth++;
+            cbor_it_to_mp_obj_recursive(ctx, &recursed, next_element);
+            ctx->depth--;
             err = cbor_value_leave_container(it, &recursed);
             if (err)
                 mp_raise_ValueError("parse error");
@@ -168,6 +372,18 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
             assert(false); // should never happen
         }
 
+        // some element types can have a variable length, so the iterator is advanced during processing.
+        // here we advance it for all other types
+        if (type != CborArrayType &&
+            type != CborMapType &&
+            type != CborTextStringType &&
+            type != CborByteStringType &&
+            type != CborTagType) {
+            err = cbor_value_advance_fixed(it);
+            if (err)
+                mp_raise_ValueError("parse error");
+        }
+
         if (parent_obj == mp_const_none) {
             return next_element;
         } else {
@@ -177,7 +393,12 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
                 mp_obj_list_append(parent_obj, next_element);
             } else if (parent_type == &mp_type_dict) {
                 if (dict_value_next) {
+                    // a duplicate key overwrites the existing entry, so the dict doesn't grow
+                    mp_map_t *map = &((mp_obj_dict_t *)MP_OBJ_TO_PTR(parent_obj))->map;
+                    size_t used = map->used;
                     mp_obj_dict_store(parent_obj, dict_key, next_element);
+                    if (ctx->strict && map->used == used)
+                        mp_raise_ValueError("duplicate key in map");
                     dict_value_next = false;
                     dict_key = mp_const_none;
                 } else {
@@ -188,17 +409,6 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
                 assert(false); // should never happen
             }
         }
-
-        // some element types can have a variable length, so the iterator is advanced during processing.
-        // here we advance it for all other types
-        if (type != CborArrayType &&
-            type != CborMapType &&
-            type != CborTextStringType &&
-            type != CborByteStringType) {
-            err = cbor_value_advance_fixed(it);
-            if (err)
-                mp_raise_ValueError("parse error");
-        }
     }
 
     if (dict_value_next)
@@ -207,160 +417,1465 @@ STATIC mp_obj_t cbor_it_to_mp_obj_recursive(CborValue *it, mp_obj_t parent_obj)
     return parent_obj;
 }
 
-STATIC mp_obj_t cbor_loads(mp_obj_t buf_obj) {
+// Fetches the optional arguments of a function, in order, either from the positional arguments that follow the
+// required ones or from the keyword arguments. Missing arguments are set to MP_OBJ_NULL.
+STATIC void get_optional_args(size_t n_args, const mp_obj_t *args, mp_map_t *kw_args, size_t n_required,
+                              const qstr *names, size_t n_names, mp_obj_t *out) {
+    size_t n_found = 0;
+
+    for (size_t i = 0; i < n_names; i++) {
+        out[i] = n_required + i < n_args ? args[n_required + i] : MP_OBJ_NULL;
+    }
+    if (n_args > n_required + n_names) {
+        mp_raise_TypeError("too many positional arguments");
+    }
+    if (kw_args == NULL) {
+        return;
+    }
+
+    // keyword names are always interned, so comparing the qstr objects is enough
+    for (size_t i = 0; i < n_names; i++) {
+        mp_obj_t key = MP_OBJ_NEW_QSTR(names[i]);
+        for (size_t j = 0; j < kw_args->alloc; j++) {
+            if (mp_map_slot_is_filled(kw_args, j) && kw_args->table[j].key == key) {
+                if (out[i] != MP_OBJ_NULL) {
+                    mp_raise_TypeError("argument given twice");
+                }
+                out[i] = kw_args->table[j].value;
+                n_found++;
+            }
+        }
+    }
+    if (n_found != kw_args->used) {
+        mp_raise_TypeError("unexpected keyword argument");
+    }
+}
+
+STATIC void get_cbor_buffer(mp_obj_t buf_obj, mp_buffer_info_t *bufinfo) {
     // get underlying buffer info, and make sure it contains bytes
-    mp_buffer_info_t bufinfo;
-    mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_READ);
-    if (bufinfo.typecode != 'B' && bufinfo.typecode != 'b') {
+    mp_get_buffer_raise(buf_obj, bufinfo, MP_BUFFER_READ);
+    if (bufinfo->typecode != 'B' && bufinfo->typecode != 'b') {
         mp_raise_ValueError("expecting bytes or bytearray");
     }
+}
+
+STATIC size_t get_limit_arg(mp_obj_t arg, size_t default_value) {
+    if (arg == MP_OBJ_NULL || arg == mp_const_none) {
+        return default_value;
+    }
+    mp_int_t limit = mp_obj_get_int(arg);
+    if (limit < 0) {
+        mp_raise_ValueError("limits must not be negative");
+    }
+    return limit;
+}
+
+// loads(buf, strict=False, max_depth=None, max_items=None, max_string_len=None, max_total_alloc=None). In strict
+// mode buf must hold exactly one item, text strings must be valid UTF-8 and map keys must be unique. The limits
+// bound the nesting depth, the number of items, the length of any one string and the bytes allocated for strings
+// and container slots; None means unlimited, except that nesting never goes past DEFAULT_MAX_DEPTH.
+STATIC mp_obj_t cbor_loads(size_t n_args, const mp_obj_t *args, mp_map_t *kw_args) {
+    const qstr names[] = { MP_QSTR_strict, MP_QSTR_max_depth, MP_QSTR_max_items, MP_QSTR_max_string_len,
+                           MP_QSTR_max_total_alloc };
+    mp_obj_t opt[5];
+    get_optional_args(n_args, args, kw_args, 1, names, 5, opt);
+
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(args[0], &bufinfo);
+
+    decode_ctx_t ctx;
+    decode_ctx_init(&ctx, &bufinfo);
+    ctx.strict = opt[0] != MP_OBJ_NULL && mp_obj_is_true(opt[0]);
+    ctx.max_depth = get_limit_arg(opt[1], DEFAULT_MAX_DEPTH);
+    if (ctx.max_depth > DEFAULT_MAX_DEPTH) {
+        ctx.max_depth = DEFAULT_MAX_DEPTH;
+    }
+    ctx.max_items = get_limit_arg(opt[2], SIZE_MAX);
+    ctx.max_string_len = get_limit_arg(opt[3], SIZE_MAX);
+    ctx.max_total_alloc = get_limit_arg(opt[4], SIZE_MAX);
 
+    // the parser flags only select between buffer and reader input; validation is done by the decoder itself
     CborParser parser;
     CborValue it;
-    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, CborValidateStrictMode, &parser, &it);
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
     if (err != CborNoError) {
         mp_raise_ValueError("tinycbor init failed");
     }
 
-    mp_obj_t result = cbor_it_to_mp_obj_recursive(&it, mp_const_none);
+    mp_obj_t result = cbor_it_to_mp_obj_recursive(&ctx, &it, mp_const_none);
+
+    if (ctx.strict && cbor_value_get_next_byte(&it) != (const uint8_t *)bufinfo.buf + bufinfo.len) {
+        mp_raise_ValueError("garbage after CBOR item");
+    }
 
     return result;
 }
 
-STATIC uint8_t *mp_obj_to_cbor_text_recursive(mp_obj_t x_obj, CborEncoder *parent_enc, size_t *encoded_len) {
-    CborEncoder new_enc;
-    CborEncoder *enc;
+STATIC uint32_t validation_flags_from_mode(mp_obj_t mode_obj) {
+    size_t len;
+    const char *mode = mp_obj_str_get_data(mode_obj, &len);
 
-    if (parent_enc == NULL) {
-        enc = &new_enc;
-    } else {
-        enc = parent_enc;
+    // the whole buffer must be a single item in every mode, so trailing bytes fail validation too
+    if (len == 5 && memcmp(mode, "basic", len) == 0) {
+        return CborValidateBasic | CborValidateCompleteData;
+    } else if (len == 6 && memcmp(mode, "strict", len) == 0) {
+        // tinycbor's strict mode without the key order: text strings must be valid UTF-8, known tags must tag the
+        // right types and lengths must be definite. Keys must be distinct as encoded bytes, unlike loads(buf,
+        // strict=True), which compares them as Python values where 1, 1.0 and True are the same key.
+        return (CborValidateStrictMode & ~(CborValidateMapIsSorted & ~CborValidateNoIndeterminateLength)) |
+               CborValidateMapKeysAreDistinct | CborValidateCompleteData;
+    } else if (len == 9 && memcmp(mode, "canonical", len) == 0) {
+        // everything strict checks as well, with sorted keys making duplicates adjacent
+        return CborValidateCanonicalFormat | CborValidateStrictMode | CborValidateCompleteData;
     }
+    mp_raise_ValueError("mode must be 'basic', 'strict' or 'canonical'");
+}
 
-    CborError err = CborNoError;
-    const mp_obj_type_t *parent_type = mp_obj_get_type(x_obj);
+// validate(buf, mode="basic") checks that buf holds exactly one well formed CBOR item, without decoding it. Only the
+// booleans are returned so that rejecting a frame never allocates.
+STATIC mp_obj_t cbor_validate(size_t n_args, const mp_obj_t *args, mp_map_t *kw_args) {
+    const qstr names[] = { MP_QSTR_mode };
+    mp_obj_t opt[1];
+    get_optional_args(n_args, args, kw_args, 1, names, 1, opt);
 
-    size_t bufsize = 64;
-    uint8_t *buf = NULL;
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(args[0], &bufinfo);
+    uint32_t flags = opt[0] == MP_OBJ_NULL ? CborValidateBasic | CborValidateCompleteData
+                                           : validation_flags_from_mode(opt[0]);
 
-    // this uses either 1 or 2 pass encoding. If the first pass runs out of memory, it continues to encode in order to
-    // count the final encoded size. Then it reallocates the buffer to the appropriate size and encodes again.
-    while (1) {
-        if (parent_enc == NULL) {
-            buf = m_realloc(buf, bufsize);
-            cbor_encoder_init(enc, buf, bufsize, CborValidateStrictMode);
-        }
-
-        if (parent_type == &mp_type_NoneType) {
-            err = cbor_encode_null(enc);
-        } else if (parent_type == &mp_type_int) {
-            err = cbor_encode_int(enc, mp_obj_get_int(x_obj));
-        } else if (parent_type->name == MP_QSTR_float) {
-            #if MICROPY_FLOAT_IMPL == MICROPY_FLOAT_IMPL_DOUBLE
-                err = cbor_encode_double(enc, mp_obj_get_float_to_d(x_obj));
-            #else
-                err = cbor_encode_float(enc, mp_obj_get_float_to_f(x_obj));
-            #endif
-        } else if (parent_type == &mp_type_str) {
-            mp_obj_t len_in = mp_obj_len(x_obj);
-            size_t len = mp_obj_get_int(len_in);
-            err = cbor_encode_text_string(enc, mp_obj_str_get_str(x_obj), len);
-        } else if (parent_type == &mp_type_bytes) {
-            mp_buffer_info_t bufinfo;
-            // This be used to get at the data for a bytestring/bytearray/string.
-            mp_get_buffer_raise(x_obj, &bufinfo, MP_BUFFER_READ);
-            err = cbor_encode_byte_string(enc, bufinfo.buf, bufinfo.len);
-        } else if (parent_type == &mp_type_list || parent_type == &mp_type_tuple) {
-            size_t list_len = mp_obj_get_int(mp_obj_len(x_obj));
-
-            CborEncoder list_enc;
-            err = cbor_encoder_create_array(enc, &list_enc, list_len);
-            if (err != CborNoError && err != CborErrorOutOfMemory) {
-                mp_raise_ValueError("Failed to encode array");
-            }
-            for (size_t i = 0; i < list_len; i++) {
-                mp_obj_t inner_obj = mp_obj_subscr(x_obj, mp_obj_new_int(i), MP_OBJ_SENTINEL);
-                mp_obj_to_cbor_text_recursive(inner_obj, &list_enc, NULL);
-            }
-            err = cbor_encoder_close_container(enc, &list_enc);
-        } else if (parent_type == &mp_type_dict) {
-            size_t dict_len = mp_obj_get_int(mp_obj_len(x_obj));
-
-            CborEncoder dict_enc;
-            err = cbor_encoder_create_map(enc, &dict_enc, dict_len);
-            if (err != CborNoError && err != CborErrorOutOfMemory) {
-                mp_raise_ValueError("Failed to encode array");
-            }
-            mp_obj_t dest[2];
-            mp_fun_table.load_method(x_obj, MP_QSTR_items, dest);
-            mp_obj_t dict_iter = mp_fun_table.call_method_n_kw(0, 0, dest);
-            mp_obj_iter_buf_t iter_buf;
-            mp_fun_table.getiter(dict_iter, &iter_buf);
-            mp_obj_t item;
-            while ((item = mp_fun_table.iternext(&iter_buf)) != MP_OBJ_NULL) {
-                // item is a tuple with structure: (key, val)
-                mp_obj_to_cbor_text_recursive(mp_obj_subscr(item, mp_obj_new_int(0), MP_OBJ_SENTINEL),
-                                              &dict_enc, NULL);
-
-                mp_obj_to_cbor_text_recursive(mp_obj_subscr(item, mp_obj_new_int(1), MP_OBJ_SENTINEL),
-                                              &dict_enc, NULL);
-            }
-            err = cbor_encoder_close_container(enc, &dict_enc);
-        } else {
-            mp_raise_ValueError("Found object which cannot be encoded");
-        }
+    CborParser parser;
+    CborValue it;
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    if (err == CborNoError) {
+        err = cbor_value_validate(&it, flags);
+    }
 
-        if (err == CborNoError) {
+    return mp_obj_new_bool(err == CborNoError);
+}
+
+// compact(buf) returns the CBOR item in buf with every array, map and string of indefinite length rewritten with its
+// length, so that it decodes faster and can be checked against limits up front. buf itself is returned when there is
+// nothing to rewrite.
+STATIC mp_obj_t cbor_compact(mp_obj_t buf_obj) {
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(buf_obj, &bufinfo);
+
+    CborParser parser;
+    CborValue it;
+    CborCompactor compactor;
+    CborError err;
+
+    // the lengths of the indefinite-length items are recorded on a first pass; there are usually few of them, so the
+    // table starts small, and a scan that outgrows it reports the size needed for a second one
+    size_t capacity = 8;
+    size_t *lengths = m_new(size_t, capacity);
+    err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    if (err == CborNoError) {
+        cbor_compactor_init(&compactor, lengths, capacity);
+        err = cbor_compactor_scan(&compactor, &it);
+    }
+    if (err == CborErrorOutOfMemory) {
+        m_free(lengths);
+        capacity = compactor.count;
+        lengths = m_new(size_t, capacity);
+        cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+        cbor_compactor_init(&compactor, lengths, capacity);
+        err = cbor_compactor_scan(&compactor, &it);
+    }
+    if (err == CborNoError && cbor_value_get_next_byte(&it) != (const uint8_t *)bufinfo.buf + bufinfo.len) {
+        err = CborErrorGarbageAtEnd;
+    }
+    if (err != CborNoError) {
+        m_free(lengths);
+        mp_raise_ValueError("parse error");
+    }
+    if (compactor.count == 0 && compactor.size == bufinfo.len) {
+        m_free(lengths);
+        return buf_obj;
+    }
+
+    uint8_t *out = m_new(uint8_t, compactor.size);
+    cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    err = cbor_compactor_write(&compactor, &it, out);
+    m_free(lengths);
+    if (err != CborNoError) {
+        m_free(out);
+        mp_raise_ValueError("parse error");
+    }
+
+    mp_obj_t result = mp_obj_new_bytes(out, compactor.size);
+    m_free(out);
+    return result;
+}
+
+// extract(buf, keys) decodes only the values of the given text string keys of the CBOR map in buf, walking the map
+// once, and returns them as a tuple in the order of keys. Keys missing from the map give None.
+STATIC mp_obj_t cbor_extract(mp_obj_t buf_obj, mp_obj_t keys_obj) {
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(buf_obj, &bufinfo);
+
+    CborParser parser;
+    CborValue it;
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    if (err != CborNoError) {
+        mp_raise_ValueError("tinycbor init failed");
+    }
+    if (!cbor_value_is_map(&it)) {
+        mp_raise_ValueError("expecting a CBOR map");
+    }
+
+    size_t n_keys = mp_obj_get_int(mp_obj_len(keys_obj));
+    const char **keys = m_new(const char *, n_keys);
+    size_t *lengths = m_new(size_t, n_keys);
+    for (size_t i = 0; i < n_keys; i++) {
+        keys[i] = mp_obj_str_get_data(mp_obj_subscr(keys_obj, mp_obj_new_int(i), MP_OBJ_SENTINEL), &lengths[i]);
+    }
+
+    CborValue *values = m_new(CborValue, n_keys);
+    err = cbor_value_map_find_values(&it, keys, lengths, n_keys, values);
+    m_free(lengths);
+    m_free(keys);
+    if (err != CborNoError) {
+        m_free(values);
+        mp_raise_ValueError("parse error");
+    }
+
+    decode_ctx_t ctx;
+    decode_ctx_init(&ctx, &bufinfo);
+    mp_obj_t *items = m_new(mp_obj_t, n_keys);
+    for (size_t i = 0; i < n_keys; i++) {
+        items[i] = cbor_value_is_valid(&values[i]) ? cbor_it_to_mp_obj_recursive(&ctx, &values[i], mp_const_none)
+                                                   : mp_const_none;
+    }
+    mp_obj_t result = mp_obj_new_tuple(n_keys, items);
+    m_free(items);
+    m_free(values);
+
+    return result;
+}
+
+// The object returned by index(buf). The index entries point into the buffer and refer to the parser, so both are
+// kept here for as long as the index lives.
+typedef struct _cbor_index_obj_t {
+    mp_obj_base_t base;
+    mp_obj_t buf_obj;
+    CborParser parser;
+    CborMapIndex index;
+} cbor_index_obj_t;
+
+STATIC mp_obj_type_t cbor_index_type;
+
+// index(buf) hashes the keys of the CBOR map in buf once, without decoding anything, and returns a read-only view
+// that decodes a value only when it is looked up. Only text string keys can be looked up.
+STATIC mp_obj_t cbor_index(mp_obj_t buf_obj) {
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(buf_obj, &bufinfo);
+
+    // a bytearray could be changed or resized under the index, so index a copy of it instead
+    if (mp_obj_get_type(buf_obj) != &mp_type_bytes) {
+        buf_obj = mp_obj_new_bytes(bufinfo.buf, bufinfo.len);
+        mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_READ);
+    }
+
+    cbor_index_obj_t *self = m_new_obj(cbor_index_obj_t);
+    self->base.type = &cbor_index_type;
+    self->buf_obj = buf_obj;
+
+    CborValue it;
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &self->parser, &it);
+    if (err != CborNoError) {
+        mp_raise_ValueError("tinycbor init failed");
+    }
+    if (!cbor_value_is_map(&it)) {
+        mp_raise_ValueError("expecting a CBOR map");
+    }
+
+    // every pair takes at least two bytes, which bounds a bogus declared length; maps of unknown length start small
+    // and the table is doubled until they fit
+    size_t pairs;
+    if (cbor_value_get_map_length(&it, &pairs) != CborNoError || pairs > bufinfo.len / 2) {
+        pairs = 4;
+    }
+    size_t capacity = cbor_map_index_capacity(pairs);
+    while (1) {
+        CborMapIndexEntry *entries = m_new(CborMapIndexEntry, capacity);
+        err = cbor_map_index_build(&it, &self->index, entries, capacity);
+        if (err != CborErrorOutOfMemory) {
             break;
-        } else if (err == CborErrorOutOfMemory) {
-            if (parent_enc == NULL) {
-                bufsize += cbor_encoder_get_extra_bytes_needed(enc);
-                continue;
-            } else {
-                if (buf != NULL) {
-                    m_free(buf);
-                }
-                return NULL;
-            }
-        } else {
-            if (buf != NULL) {
-                m_free(buf);
-            }
-            mp_raise_ValueError("CBOR encoding failed");
         }
+        m_free(entries);
+        capacity *= 2;
+    }
+    if (err != CborNoError) {
+        mp_raise_ValueError("parse error");
     }
 
-    if (parent_enc == NULL) {
-        *encoded_len = cbor_encoder_get_buffer_size(enc, buf);
-        return buf;
-    } else {
-        return NULL;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+STATIC bool cbor_index_find(cbor_index_obj_t *self, mp_obj_t key, CborValue *value) {
+    if (mp_obj_get_type(key) != &mp_type_str) {
+        return false;
+    }
+
+    size_t len;
+    const char *str = mp_obj_str_get_data(key, &len);
+    if (cbor_map_index_find(&self->index, str, len, value) != CborNoError) {
+        mp_raise_ValueError("parse error");
     }
+    return cbor_value_is_valid(value);
 }
 
-STATIC mp_obj_t cbor_dumps(mp_obj_t x_obj) {
-    size_t len = 0;
-    uint8_t *buf = mp_obj_to_cbor_text_recursive(x_obj, NULL, &len);
+STATIC mp_obj_t cbor_index_decode(cbor_index_obj_t *self, CborValue *value) {
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(self->buf_obj, &bufinfo, MP_BUFFER_READ);
+
+    decode_ctx_t ctx;
+    decode_ctx_init(&ctx, &bufinfo);
+    return cbor_it_to_mp_obj_recursive(&ctx, value, mp_const_none);
+}
 
-    if (buf == NULL) {
-        mp_raise_ValueError("CBOR encoding failed");
+STATIC mp_obj_t cbor_index_subscr(mp_obj_t self_in, mp_obj_t key, mp_obj_t value) {
+    if (value != MP_OBJ_SENTINEL) {
+        mp_raise_TypeError("index is read-only");
     }
 
-    mp_obj_t result = mp_obj_new_bytes(buf, len);
-    m_free(buf);
+    CborValue found;
+    if (!cbor_index_find(MP_OBJ_TO_PTR(self_in), key, &found)) {
+        nlr_raise(mp_call_function_n_kw(MP_OBJ_FROM_PTR(&mp_type_KeyError), 1, 0, &key));
+    }
+    return cbor_index_decode(MP_OBJ_TO_PTR(self_in), &found);
+}
 
-    return result;
+STATIC mp_obj_t cbor_index_binary_op(mp_binary_op_t op, mp_obj_t lhs_in, mp_obj_t rhs_in) {
+    if (op != MP_BINARY_OP_CONTAINS) {
+        return MP_OBJ_NULL; // op not supported
+    }
+
+    CborValue found;
+    return mp_obj_new_bool(cbor_index_find(MP_OBJ_TO_PTR(lhs_in), rhs_in, &found));
 }
 
-STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_loads_obj, cbor_loads);
-STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_dumps_obj, cbor_dumps);
+// get(key, default=None), as for dicts
+STATIC mp_obj_t cbor_index_get(size_t n_args, const mp_obj_t *args) {
+    CborValue found;
+    if (!cbor_index_find(MP_OBJ_TO_PTR(args[0]), args[1], &found)) {
+        return n_args > 2 ? args[2] : mp_const_none;
+    }
+    return cbor_index_decode(MP_OBJ_TO_PTR(args[0]), &found);
+}
 
-// This is the entry point and is called when the module is imported
-mp_obj_t mpy_init(mp_obj_fun_bc_t *self, size_t n_args, size_t n_kw, mp_obj_t *args) {
-    MP_DYNRUNTIME_INIT_ENTRY
+// The object returned by view(buf), and by subscripting a view where the value is an array or map. Views of nested
+// containers share the buffer and the tape of the outermost one, and differ only in their entry.
+typedef struct _cbor_view_obj_t {
+    mp_obj_base_t base;
+    mp_obj_t buf_obj;
+    CborTape *tape;
+    size_t entry;
+} cbor_view_obj_t;
 
-    mp_store_global(MP_QSTR_loads, MP_OBJ_FROM_PTR(&cbor_loads_obj));
-    mp_store_global(MP_QSTR_dumps, MP_OBJ_FROM_PTR(&cbor_dumps_obj));
+STATIC mp_obj_type_t cbor_view_type;
+
+STATIC mp_obj_t cbor_view_new(mp_obj_t buf_obj, CborTape *tape, size_t entry) {
+    cbor_view_obj_t *self = m_new_obj(cbor_view_obj_t);
+    self->base.type = &cbor_view_type;
+    self->buf_obj = buf_obj;
+    self->tape = tape;
+    self->entry = entry;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+// view(buf) records the structure of the CBOR array or map in buf in one pass, without decoding anything, and
+// returns a read-only view of it. len() and indexing an array take constant time, a map is searched key by key
+// without parsing the values, and nested arrays and maps come back as views themselves.
+STATIC mp_obj_t cbor_view(mp_obj_t buf_obj) {
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(buf_obj, &bufinfo);
+
+    // a bytearray could be changed or resized under the view, so view a copy of it instead
+    if (mp_obj_get_type(buf_obj) != &mp_type_bytes) {
+        buf_obj = mp_obj_new_bytes(bufinfo.buf, bufinfo.len);
+        mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_READ);
+    }
+
+    CborParser parser;
+    CborValue it;
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    if (err != CborNoError) {
+        mp_raise_ValueError("tinycbor init failed");
+    }
+    if (!cbor_value_is_array(&it) && !cbor_value_is_map(&it)) {
+        mp_raise_ValueError("expecting a CBOR array or map");
+    }
+
+    // a first pass with no storage measures the tape, and the second fills in exactly that much
+    CborTape *tape = m_new_obj(CborTape);
+    cbor_tape_init(tape, NULL, 0, NULL, 0);
+    err = cbor_tape_build(tape, &it);
+    if (err == CborErrorOutOfMemory) {
+        cbor_tape_init(tape, m_new(CborTapeEntry, tape->count), tape->count, m_new(uint32_t, tape->childCount),
+                       tape->childCount);
+        cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+        err = cbor_tape_build(tape, &it);
+    }
+    if (err != CborNoError) {
+        mp_raise_ValueError("parse error");
+    }
+
+    return cbor_view_new(buf_obj, tape, 0);
+}
+
+// Returns the value at entry as a view if it is an array or map, and decoded otherwise.
+STATIC mp_obj_t cbor_view_value(cbor_view_obj_t *self, size_t entry) {
+    CborType type = cbor_tape_get_type(self->tape, entry);
+    if (type == CborArrayType || type == CborMapType) {
+        return cbor_view_new(self->buf_obj, self->tape, entry);
+    }
+
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(self->buf_obj, &bufinfo, MP_BUFFER_READ);
+
+    CborParser parser;
+    CborValue it;
+    cbor_tape_value_at(self->tape, entry, &parser, &it);
+    decode_ctx_t ctx;
+    decode_ctx_init(&ctx, &bufinfo);
+    return cbor_it_to_mp_obj_recursive(&ctx, &it, mp_const_none);
+}
+
+// Compares the map key at entry with str, as cbor_map_index_find() does: tags are ignored, and a text string split
+// into chunks matches if the chunks put together do.
+STATIC bool cbor_view_key_matches(cbor_view_obj_t *self, size_t entry, const char *str, size_t len) {
+    CborParser parser;
+    CborValue it;
+    CborError err = cbor_tape_value_at(self->tape, entry, &parser, &it);
+    if (err == CborNoError) {
+        err = cbor_value_skip_tag(&it);
+    }
+    if (err != CborNoError) {
+        mp_raise_ValueError("parse error");
+    }
+    if (!cbor_value_is_text_string(&it)) {
+        return false;
+    }
+
+    if (cbor_value_begin_string_iteration(&it) != CborNoError) {
+        mp_raise_ValueError("parse error");
+    }
+    size_t offset = 0;
+    while (1) {
+        const char *chunk;
+        size_t chunk_len;
+        err = cbor_value_get_text_string_chunk(&it, &chunk, &chunk_len, &it);
+        if (err == CborErrorNoMoreStringChunks) {
+            return offset == len;
+        }
+        if (err != CborNoError) {
+            mp_raise_ValueError("parse error");
+        }
+        if (chunk_len > len - offset || memcmp(chunk, str + offset, chunk_len) != 0) {
+            return false;
+        }
+        offset += chunk_len;
+    }
+}
+
+STATIC mp_obj_t cbor_view_subscr(mp_obj_t self_in, mp_obj_t index, mp_obj_t value) {
+    if (value != MP_OBJ_SENTINEL) {
+        mp_raise_TypeError("view is read-only");
+    }
+
+    cbor_view_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    size_t count = cbor_tape_get_count(self->tape, self->entry);
+    if (cbor_tape_get_type(self->tape, self->entry) == CborArrayType) {
+        mp_int_t i = mp_obj_get_int(index);
+        if (i < 0) {
+            i += count;
+        }
+        if (i < 0 || (size_t)i >= count) {
+            nlr_raise(mp_call_function_n_kw(MP_OBJ_FROM_PTR(&mp_type_IndexError), 1, 0, &index));
+        }
+        return cbor_view_value(self, cbor_tape_child(self->tape, self->entry, i));
+    }
+
+    // maps alternate keys and values; the first occurrence of a repeated key wins
+    if (mp_obj_get_type(index) == &mp_type_str) {
+        size_t len;
+        const char *str = mp_obj_str_get_data(index, &len);
+        for (size_t i = 0; i < count; i += 2) {
+            if (cbor_view_key_matches(self, cbor_tape_child(self->tape, self->entry, i), str, len)) {
+                return cbor_view_value(self, cbor_tape_child(self->tape, self->entry, i + 1));
+            }
+        }
+    }
+    nlr_raise(mp_call_function_n_kw(MP_OBJ_FROM_PTR(&mp_type_KeyError), 1, 0, &index));
+}
+
+STATIC mp_obj_t cbor_view_unary_op(mp_unary_op_t op, mp_obj_t self_in) {
+    if (op != MP_UNARY_OP_LEN) {
+        return MP_OBJ_NULL; // op not supported
+    }
+
+    cbor_view_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    size_t count = cbor_tape_get_count(self->tape, self->entry);
+    if (cbor_tape_get_type(self->tape, self->entry) == CborMapType) {
+        count /= 2;
+    }
+    return mp_obj_new_int_from_uint(count);
+}
+
+// Encoders for one kind of object each. They return CborErrorOutOfMemory when the output buffer can't grow, which
+// mp_obj_to_cbor reports once encoding unwinds.
+typedef CborError (*encode_fun_t)(CborEncoder *enc, mp_obj_t obj);
+
+typedef struct _encode_handler_t {
+    const mp_obj_type_t *type;
+    // types that natmods have no pointer to are matched by name instead, with type set to NULL
+    qstr name;
+    encode_fun_t fun;
+    // set for classes derived from a native type: the object is an instance wrapping the native object to encode
+    bool unwrap;
+} encode_handler_t;
+
+// The start of an instance of a class derived from a native type, as laid out by py/objtype.h. subobj[0] holds
+// the native object.
+typedef struct _native_subclass_obj_t {
+    mp_obj_base_t base;
+    mp_map_t members;
+    mp_obj_t subobj[];
+} native_subclass_obj_t;
+
+// Filled in by mpy_init, since types aren't constant in a native module.
+#define N_ENCODE_HANDLERS (12)
+STATIC encode_handler_t encode_handlers[N_ENCODE_HANDLERS];
+
+// The getiter slot shared by all classes defined in Python, which raises TypeError unless the class has __iter__.
+STATIC mp_getiter_fun_t instance_getiter;
+
+STATIC CborError encode_iterable(CborEncoder *enc, mp_obj_t obj);
+STATIC CborError encode_mapping(CborEncoder *enc, mp_obj_t obj);
+
+// Whether the locals of type itself, not those of its bases, hold key.
+STATIC bool type_defines(const mp_obj_type_t *type, mp_obj_t key) {
+    if (type->locals_dict == NULL) {
+        return false;
+    }
+    const mp_map_t *map = &type->locals_dict->map;
+    for (size_t i = 0; i < map->alloc; i++) {
+        if (map->table[i].key == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a class defined in Python, or one of its bases, defines the method name. Native types have their
+// handlers in the table and are never looked at.
+STATIC bool type_has_method(const mp_obj_type_t *type, qstr name) {
+    for (const mp_obj_type_t *t = type; t != NULL && t->base.type == &mp_type_type; t = t->parent) {
+        if (type_defines(t, MP_OBJ_NEW_QSTR(name))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether objects of type can be iterated over. Every class defined in Python has a getiter slot, so for those the
+// first base that is either native or defines __iter__ decides.
+STATIC bool type_is_iterable(const mp_obj_type_t *type) {
+    for (const mp_obj_type_t *t = type; t != NULL && t->base.type == &mp_type_type; t = t->parent) {
+        if (t->getiter != instance_getiter) {
+            return t->getiter != NULL;
+        }
+        if (type_defines(t, MP_OBJ_NEW_QSTR(MP_QSTR___iter__))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+STATIC void encode_handler_lookup(const mp_obj_type_t *type, encode_handler_t *handler) {
+    handler->type = type;
+    handler->fun = NULL;
+    handler->unwrap = false;
+
+    // walk up the bases so that subclasses of native types encode like their base; only single inheritance is
+    // followed, since with several bases parent points to a tuple of them
+    const mp_obj_type_t *t = type;
+    while (t != NULL && t->base.type == &mp_type_type) {
+        for (size_t i = 0; i < N_ENCODE_HANDLERS; i++) {
+            const encode_handler_t *h = &encode_handlers[i];
+            if (h->type == NULL ? t->name == h->name : t == h->type) {
+                handler->fun = h->fun;
+                // classes defined in Python all construct through the instance constructor, while native variants
+                // such as OrderedDict share the constructor and object layout of their base
+                handler->unwrap = t != type && type->make_new != t->make_new;
+                return;
+            }
+        }
+        t = t->parent;
+    }
+
+    // anything else that can be iterated over is streamed out with an indefinite length, as a map when its class has
+    // an items() method and as an array otherwise
+    if (type_has_method(type, MP_QSTR_items)) {
+        handler->fun = encode_mapping;
+    } else if (type_is_iterable(type)) {
+        handler->fun = encode_iterable;
+    } else {
+        mp_raise_ValueError("Found object which cannot be encoded");
+    }
+}
+
+// Encodes obj, looking up its handler only when its type differs from that of the previous object encoded with the
+// same cache, as is the case for most items of a container.
+STATIC CborError encode_obj(CborEncoder *enc, mp_obj_t obj, encode_handler_t *cache) {
+    const mp_obj_type_t *type = mp_obj_get_type(obj);
+    if (type != cache->type) {
+        encode_handler_lookup(type, cache);
+    }
+    if (cache->unwrap) {
+        obj = ((native_subclass_obj_t *)MP_OBJ_TO_PTR(obj))->subobj[0];
+    }
+    return cache->fun(enc, obj);
+}
+
+STATIC CborError encode_none(CborEncoder *enc, mp_obj_t obj) {
+    return cbor_encode_null(enc);
+}
+
+STATIC CborError encode_bool(CborEncoder *enc, mp_obj_t obj) {
+    return cbor_encode_boolean(enc, obj == mp_const_true);
+}
+
+STATIC CborError encode_int(CborEncoder *enc, mp_obj_t obj) {
+    if (mp_obj_is_small_int(obj)) {
+        return cbor_encode_int(enc, MP_OBJ_SMALL_INT_VALUE(obj));
+    }
+
+    // a big int: CBOR stores a negative n as -1 - n, which is ~n, so only magnitudes are ever encoded
+    bool negative = mp_obj_is_true(mp_binary_op(MP_BINARY_OP_LESS, obj, MP_OBJ_NEW_SMALL_INT(0)));
+    if (negative) {
+        obj = mp_unary_op(MP_UNARY_OP_INVERT, obj);
+    }
+
+    // int.to_bytes() truncates silently, so it needs a length that holds the whole value. Converting to a float
+    // allocates nothing and its exponent gives the number of bits, give or take the rounding, which the spare byte
+    // covers. Past the float range, the length of hex() tells instead.
+    union {
+        double d;
+        uint64_t u;
+    } f = { mp_obj_get_float_to_d(obj) };
+    size_t len;
+    if (f.d - f.d == 0) {
+        size_t bits = f.d < 1 ? 0 : (size_t)((f.u >> 52) & 0x7ff) - 1022;
+        len = (bits + 7) / 8 + 1;
+    } else {
+        len = (mp_obj_get_int(mp_obj_len(mp_call_function_n_kw(mp_load_global(MP_QSTR_hex), 1, 0, &obj))) - 2 + 1) / 2;
+    }
+    mp_obj_t dest[4];
+    mp_load_method(obj, MP_QSTR_to_bytes, dest);
+    dest[2] = MP_OBJ_NEW_SMALL_INT(len);
+    dest[3] = MP_OBJ_NEW_QSTR(MP_QSTR_big);
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(mp_call_method_n_kw(2, 0, dest), &bufinfo, MP_BUFFER_READ);
+    const uint8_t *bytes = bufinfo.buf;
+    while (len > 0 && *bytes == 0) {
+        bytes++;
+        len--;
+    }
+
+    if (len <= 8) {
+        uint64_t n = 0;
+        for (size_t i = 0; i < len; i++) {
+            n = (n << 8) | bytes[i];
+        }
+        // cbor_encode_negative_int() takes the absolute value, ~obj + 1, which wraps to 0 for -2**64 as it expects
+        return negative ? cbor_encode_negative_int(enc, n + 1) : cbor_encode_uint(enc, n);
+    }
+
+    CborError err = cbor_encode_tag(enc, negative ? CborNegativeBignumTag : CborPositiveBignumTag);
+    if (err != CborNoError && err != CborErrorOutOfMemory) {
+        return err;
+    }
+    CborError err2 = cbor_encode_byte_string(enc, bytes, len);
+    return err2 != CborNoError ? err2 : err;
+}
+
+STATIC CborError encode_float(CborEncoder *enc, mp_obj_t obj) {
+    #if MICROPY_FLOAT_IMPL == MICROPY_FLOAT_IMPL_DOUBLE
+        return cbor_encode_double(enc, mp_obj_get_float_to_d(obj));
+    #else
+        return cbor_encode_float(enc, mp_obj_get_float_to_f(obj));
+    #endif
+}
+
+// Output of dumps_segments(): a list of memoryviews. Long strings get a view of the object they come from rather than
+// a copy, so the encoders of strings record that object in source while they write its contents.
+typedef struct _encode_segments_t {
+    mp_obj_t list;
+    mp_obj_t source;
+} encode_segments_t;
+
+// Output of dump(): the bound write() method of the stream, as set up by mp_load_method, and the source of long
+// strings, as for dumps_segments().
+typedef struct _encode_stream_t {
+    mp_obj_t dest[3];
+    mp_obj_t source;
+} encode_stream_t;
+
+STATIC CborError encode_segment_write(void *token, const void *data, size_t len, CborEncoderAppendType append_type);
+STATIC CborError encode_stream_write(void *token, const void *data, size_t len, CborEncoderAppendType append_type);
+
+STATIC void encode_set_source(CborEncoder *enc, mp_obj_t obj) {
+    CborEncoderStage *stage = cbor_encoder_get_stage(enc);
+    if (stage == NULL) {
+        return;
+    }
+    if (stage->writer == encode_segment_write) {
+        ((encode_segments_t *)stage->token)->source = obj;
+    } else if (stage->writer == encode_stream_write) {
+        ((encode_stream_t *)stage->token)->source = obj;
+    }
+}
+
+// The read-only memoryview handed out for a block of output: a view of the object a long string comes from, or of a
+// copy of anything else, since the staging buffer is reused for the next block and freed at the end.
+STATIC mp_obj_t encode_block_view(mp_obj_t source, const void *data, size_t len, CborEncoderAppendType append_type) {
+    mp_obj_t block = append_type == CborEncoderAppendStringData && source != MP_OBJ_NULL
+        ? source
+        : mp_obj_new_bytes(data, len);
+    return mp_call_function_n_kw(mp_load_global(MP_QSTR_memoryview), 1, 0, &block);
+}
+
+STATIC CborError encode_str(CborEncoder *enc, mp_obj_t obj) {
+    // the length in bytes, which len() isn't for non-ASCII text
+    size_t len;
+    const char *str = mp_obj_str_get_data(obj, &len);
+    encode_set_source(enc, obj);
+    CborError err = cbor_encode_text_string(enc, str, len);
+    encode_set_source(enc, MP_OBJ_NULL);
+    return err;
+}
+
+// bytes, bytearray, memoryview and array all encode as a byte string of their contents
+STATIC CborError encode_buffer(CborEncoder *enc, mp_obj_t obj) {
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(obj, &bufinfo, MP_BUFFER_READ);
+    encode_set_source(enc, obj);
+    CborError err = cbor_encode_byte_string(enc, bufinfo.buf, bufinfo.len);
+    encode_set_source(enc, MP_OBJ_NULL);
+    return err;
+}
+
+// lists and tuples
+STATIC CborError encode_array(CborEncoder *enc, mp_obj_t obj) {
+    size_t list_len = mp_obj_get_int(mp_obj_len(obj));
+
+    CborEncoder list_enc;
+    CborError err = cbor_encoder_create_array(enc, &list_enc, list_len);
+    if (err != CborNoError && err != CborErrorOutOfMemory) {
+        mp_raise_ValueError("Failed to encode array");
+    }
+    encode_handler_t cache = { NULL };
+    for (size_t i = 0; i < list_len; i++) {
+        err = encode_obj(&list_enc, mp_obj_subscr(obj, mp_obj_new_int(i), MP_OBJ_SENTINEL), &cache);
+        if (err != CborNoError && err != CborErrorOutOfMemory) {
+            return err;
+        }
+    }
+    return cbor_encoder_close_container(enc, &list_enc);
+}
+
+// Encodes the (key, value) pairs returned by obj.items() as a map of dict_len pairs, which may be
+// CborIndefiniteLength.
+STATIC CborError encode_items(CborEncoder *enc, mp_obj_t obj, size_t dict_len) {
+    CborEncoder dict_enc;
+    CborError err = cbor_encoder_create_map(enc, &dict_enc, dict_len);
+    if (err != CborNoError && err != CborErrorOutOfMemory) {
+        mp_raise_ValueError("Failed to encode array");
+    }
+    mp_obj_t dest[2];
+    mp_fun_table.load_method(obj, MP_QSTR_items, dest);
+    mp_obj_t dict_iter = mp_fun_table.call_method_n_kw(0, 0, dest);
+    mp_obj_iter_buf_t iter_buf;
+    mp_fun_table.getiter(dict_iter, &iter_buf);
+    mp_obj_t item;
+    // keys are usually all strings while values vary, so each gets its own cache
+    encode_handler_t key_cache = { NULL };
+    encode_handler_t value_cache = { NULL };
+    while ((item = mp_fun_table.iternext(&iter_buf)) != MP_OBJ_NULL) {
+        // item is a tuple with structure: (key, val)
+        err = encode_obj(&dict_enc, mp_obj_subscr(item, mp_obj_new_int(0), MP_OBJ_SENTINEL), &key_cache);
+        if (err != CborNoError && err != CborErrorOutOfMemory) {
+            return err;
+        }
+        err = encode_obj(&dict_enc, mp_obj_subscr(item, mp_obj_new_int(1), MP_OBJ_SENTINEL), &value_cache);
+        if (err != CborNoError && err != CborErrorOutOfMemory) {
+            return err;
+        }
+    }
+    return cbor_encoder_close_container(enc, &dict_enc);
+}
+
+STATIC CborError encode_dict(CborEncoder *enc, mp_obj_t obj) {
+    return encode_items(enc, obj, mp_obj_get_int(mp_obj_len(obj)));
+}
+
+STATIC CborError encode_mapping(CborEncoder *enc, mp_obj_t obj) {
+    return encode_items(enc, obj, CborIndefiniteLength);
+}
+
+// Encodes the items of any iterable, generators included, as they are produced, so the length isn't known
+// up front.
+STATIC CborError encode_iterable(CborEncoder *enc, mp_obj_t obj) {
+    CborEncoder list_enc;
+    CborError err = cbor_encoder_create_array(enc, &list_enc, CborIndefiniteLength);
+    if (err != CborNoError && err != CborErrorOutOfMemory) {
+        mp_raise_ValueError("Failed to encode array");
+    }
+    mp_obj_iter_buf_t iter_buf;
+    mp_fun_table.getiter(obj, &iter_buf);
+    mp_obj_t item;
+    encode_handler_t cache = { NULL };
+    while ((item = mp_fun_table.iternext(&iter_buf)) != MP_OBJ_NULL) {
+        err = encode_obj(&list_enc, item, &cache);
+        if (err != CborNoError && err != CborErrorOutOfMemory) {
+            return err;
+        }
+    }
+    return cbor_encoder_close_container(enc, &list_enc);
+}
+
+STATIC void encode_handlers_init(void) {
+    // natmods have no pointer to the instance getiter, so it is taken from a class made with type()
+    mp_obj_t class_args[3] = { MP_OBJ_NEW_QSTR(MP_QSTR_probe), mp_obj_new_tuple(0, NULL), mp_obj_new_dict(0) };
+    mp_obj_t probe = mp_call_function_n_kw(mp_load_global(MP_QSTR_type), 3, 0, class_args);
+    instance_getiter = ((mp_obj_type_t *)MP_OBJ_TO_PTR(probe))->getiter;
+
+    // bool and NoneType aren't exported to native modules, so their types are taken from their constants
+    const encode_handler_t handlers[N_ENCODE_HANDLERS] = {
+        { mp_obj_get_type(mp_const_none), 0, encode_none, false },
+        { mp_obj_get_type(mp_const_false), 0, encode_bool, false },
+        { &mp_type_int, 0, encode_int, false },
+        { mp_obj_get_type(mp_obj_new_float_from_f(0)), 0, encode_float, false },
+        { &mp_type_str, 0, encode_str, false },
+        { &mp_type_bytes, 0, encode_buffer, false },
+        { mp_obj_get_type(mp_obj_new_bytearray_by_ref(0, NULL)), 0, encode_buffer, false },
+        { NULL, MP_QSTR_memoryview, encode_buffer, false },
+        { NULL, MP_QSTR_array, encode_buffer, false },
+        { &mp_type_list, 0, encode_array, false },
+        { &mp_type_tuple, 0, encode_array, false },
+        { &mp_type_dict, 0, encode_dict, false },
+    };
+    for (size_t i = 0; i < N_ENCODE_HANDLERS; i++) {
+        encode_handlers[i] = handlers[i];
+    }
+}
+
+STATIC void raise_encode_error(CborError err) {
+    if (err == CborErrorOutOfMemory) {
+        mp_raise_msg(&mp_type_MemoryError, "CBOR encoding ran out of memory");
+    }
+    if (err == CborErrorIO) {
+        mp_raise_msg(&mp_type_OSError, "stream write incomplete");
+    }
+    mp_raise_ValueError("CBOR encoding failed");
+}
+
+// Output of the encoder: a heap buffer that grows as the encoder writes to it.
+typedef struct _encode_buf_t {
+    uint8_t *data;
+    size_t len;
+    size_t alloc;
+} encode_buf_t;
+
+// Makes room for len more bytes, at least doubling the buffer when it has to grow.
+STATIC void buf_reserve(encode_buf_t *out, size_t len) {
+    if (len > out->alloc - out->len) {
+        size_t alloc = out->alloc == 0 ? 64 : out->alloc * 2;
+        while (len > alloc - out->len) {
+            alloc *= 2;
+        }
+        out->data = m_realloc(out->data, alloc);
+        out->alloc = alloc;
+    }
+}
+
+STATIC CborError buf_append(encode_buf_t *out, const void *data, size_t len) {
+    buf_reserve(out, len);
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return CborNoError;
+}
+
+STATIC CborError encode_buf_write(void *token, const void *data, size_t len, CborEncoderAppendType append_type) {
+    return buf_append(token, data, len);
+}
+
+// Output of dumps(): the stage of a staged writer is the free tail of a heap buffer, so the encoder stores into the
+// buffer directly, as in buffer mode, and only calls encode_tail_write once the tail is full. The gathered bytes are
+// then taken into the buffer as they are, the buffer grows, and the stage moves to the new tail.
+typedef struct _encode_tail_t {
+    encode_buf_t buf;
+    CborEncoderStage stage;
+} encode_tail_t;
+
+STATIC CborError encode_tail_write(void *token, const void *data, size_t len, CborEncoderAppendType append_type) {
+    encode_tail_t *out = token;
+    if (data == out->stage.buffer) {
+        out->buf.len += len;
+    } else {
+        buf_append(&out->buf, data, len);
+    }
+    buf_reserve(&out->buf, out->buf.len);
+    out->stage.buffer = out->buf.data + out->buf.len;
+    out->stage.size = out->buf.alloc - out->buf.len;
+    return CborNoError;
+}
+
+STATIC uint8_t *mp_obj_to_cbor(mp_obj_t x_obj, size_t *encoded_len) {
+    CborEncoder enc;
+    encode_handler_t cache = { NULL };
+    encode_tail_t out = { { NULL, 0, 0 }, { NULL } };
+
+    // a single pass, since iterators can only be consumed once
+    buf_reserve(&out.buf, 64);
+    cbor_encoder_init_staged_writer(&enc, &out.stage, encode_tail_write, &out, out.buf.data, out.buf.alloc);
+    CborError err = encode_obj(&enc, x_obj, &cache);
+    if (err == CborNoError) {
+        err = cbor_encoder_flush(&enc);
+    }
+    if (err != CborNoError) {
+        m_free(out.buf.data);
+        raise_encode_error(err);
+    }
+
+    *encoded_len = out.buf.len;
+    return out.buf.data;
+}
+
+// Size of the buffer dump() and dumps_segments() gather writes in; longer strings are written on their own.
+#define ENCODE_STAGE_SIZE (256)
+
+// Writes data with the stream's write() method. Anything but the full length as the result, including the None of a
+// non-blocking stream that wrote nothing, means the data was lost.
+STATIC CborError encode_stream_write(void *token, const void *data, size_t len, CborEncoderAppendType append_type) {
+    encode_stream_t *out = token;
+    out->dest[2] = encode_block_view(out->source, data, len, append_type);
+    mp_obj_t written = mp_fun_table.call_method_n_kw(1, 0, out->dest);
+    if (!mp_obj_is_int(written) || (size_t)mp_obj_get_int(written) != len) {
+        return CborErrorIO;
+    }
+    return CborNoError;
+}
+
+// dump(obj, stream) encodes obj straight to stream, which needs a write() method, calling it once per block of
+// ENCODE_STAGE_SIZE bytes rather than once per value.
+STATIC mp_obj_t cbor_dump(mp_obj_t x_obj, mp_obj_t stream_obj) {
+    encode_stream_t out = { { MP_OBJ_NULL }, MP_OBJ_NULL };
+    mp_fun_table.load_method(stream_obj, MP_QSTR_write, out.dest);
+
+    CborEncoder enc;
+    CborEncoderStage stage;
+    encode_handler_t cache = { NULL };
+    uint8_t *staging = m_new(uint8_t, ENCODE_STAGE_SIZE);
+
+    cbor_encoder_init_staged_writer(&enc, &stage, encode_stream_write, &out, staging, ENCODE_STAGE_SIZE);
+    CborError err = encode_obj(&enc, x_obj, &cache);
+    if (err == CborNoError) {
+        err = cbor_encoder_flush(&enc);
+    }
+    m_free(staging);
+    if (err != CborNoError) {
+        raise_encode_error(err);
+    }
+
+    return mp_const_none;
+}
+
+STATIC mp_obj_t cbor_dumps(mp_obj_t x_obj) {
+    size_t len = 0;
+    uint8_t *buf = mp_obj_to_cbor(x_obj, &len);
+
+    mp_obj_t result = mp_obj_new_bytes(buf, len);
+    m_free(buf);
+
+    return result;
+}
+
+// Appends the segment for data: a view of the string being written if the stage passed it through, otherwise a view
+// of a copy of the gathered bytes, since the stage is reused.
+STATIC CborError encode_segment_write(void *token, const void *data, size_t len, CborEncoderAppendType append_type) {
+    encode_segments_t *out = token;
+    mp_obj_list_append(out->list, encode_block_view(out->source, data, len, append_type));
+    return CborNoError;
+}
+
+// dumps_segments(obj) encodes obj like dumps(), but as a list of memoryviews to be written out in turn. Strings of
+// ENCODE_STAGE_SIZE bytes or more aren't copied: their segment is a view of the str, bytes, bytearray or memoryview
+// they were encoded from, so such objects must not change while the segments are in use.
+STATIC mp_obj_t cbor_dumps_segments(mp_obj_t x_obj) {
+    encode_segments_t out = { mp_obj_new_list(0, NULL), MP_OBJ_NULL };
+
+    CborEncoder enc;
+    CborEncoderStage stage;
+    encode_handler_t cache = { NULL };
+    uint8_t *staging = m_new(uint8_t, ENCODE_STAGE_SIZE);
+
+    cbor_encoder_init_staged_writer(&enc, &stage, encode_segment_write, &out, staging, ENCODE_STAGE_SIZE);
+    CborError err = encode_obj(&enc, x_obj, &cache);
+    if (err == CborNoError) {
+        err = cbor_encoder_flush(&enc);
+    }
+    m_free(staging);
+    if (err != CborNoError) {
+        raise_encode_error(err);
+    }
+
+    return out.list;
+}
+
+STATIC CborError json_buf_write(void *token, const char *data, size_t len) {
+    return buf_append(token, data, len);
+}
+
+// Formats the non-integral numbers of to_json() the way repr() does, which reads back to the same float.
+STATIC size_t json_format_double(char *buffer, size_t size, double value) {
+    mp_obj_t f = mp_obj_new_float_from_d(value);
+    size_t len;
+    const char *str = mp_obj_str_get_data(mp_call_function_n_kw(mp_load_global(MP_QSTR_repr), 1, 0, &f), &len);
+    if (len > size) {
+        return 0;
+    }
+    memcpy(buffer, str, len);
+    return len;
+}
+
+// to_json(buf) converts the CBOR item in buf to JSON text without building the Python objects in between. Byte
+// strings become base64url strings and NaN or infinite numbers become null; map keys must be text strings.
+STATIC mp_obj_t cbor_to_json(mp_obj_t buf_obj) {
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(buf_obj, &bufinfo);
+
+    CborParser parser;
+    CborValue it;
+    encode_buf_t out = { NULL, 0, 0 };
+    CborJsonStream stream = { json_buf_write, json_format_double, &out };
+
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    if (err == CborNoError) {
+        err = cbor_value_to_json_stream(&stream, &it, CborConvertDefaultFlags);
+    }
+    if (err == CborNoError && cbor_value_get_next_byte(&it) != (const uint8_t *)bufinfo.buf + bufinfo.len) {
+        err = CborErrorGarbageAtEnd;
+    }
+    if (err != CborNoError) {
+        m_free(out.data);
+        if (err == CborErrorOutOfMemory) {
+            mp_raise_msg(&mp_type_MemoryError, "JSON conversion ran out of memory");
+        }
+        mp_raise_ValueError("cannot convert to JSON");
+    }
+
+    mp_obj_t result = mp_obj_new_str((const char *)out.data, out.len);
+    m_free(out.data);
+    return result;
+}
+
+// Parses the numbers from_json() can't convert exactly on its own with float(), as json.loads() would.
+STATIC CborError json_parse_number(const char *text, size_t len, double *value) {
+    mp_obj_t str = mp_obj_new_str(text, len);
+    *value = mp_obj_get_float_to_d(mp_call_function_n_kw(mp_load_global(MP_QSTR_float), 1, 0, &str));
+    return CborNoError;
+}
+
+// from_json(text) converts JSON text, a str or bytes, to CBOR without building the Python objects in between. Objects
+// and arrays are encoded with indefinite lengths, which compact() can rewrite; integers beyond the 64-bit CBOR range
+// become floats.
+STATIC mp_obj_t cbor_from_json(mp_obj_t text_obj) {
+    size_t len;
+    const char *text = mp_obj_str_get_data(text_obj, &len);
+
+    CborEncoder enc;
+    encode_buf_t out = { NULL, 0, 0 };
+    cbor_encoder_init_writer(&enc, encode_buf_write, &out);
+    CborError err = cbor_encode_json(&enc, text, len, json_parse_number);
+    if (err != CborNoError) {
+        m_free(out.data);
+        if (err == CborErrorOutOfMemory) {
+            mp_raise_msg(&mp_type_MemoryError, "JSON conversion ran out of memory");
+        }
+        mp_raise_ValueError("invalid JSON");
+    }
+
+    mp_obj_t result = mp_obj_new_bytes(out.data, out.len);
+    m_free(out.data);
+    return result;
+}
+
+// Diagnostic output of diag(): the text is clipped to max_len characters, after which writing stops.
+#define DEFAULT_DIAG_LEN (256)
+
+typedef struct _diag_out_t {
+    encode_buf_t buf;
+    size_t max_len;
+    bool truncated;
+} diag_out_t;
+
+STATIC CborError diag_put(diag_out_t *out, const char *data, size_t len) {
+    if (len > out->max_len - out->buf.len) {
+        len = out->max_len - out->buf.len;
+        out->truncated = true;
+    }
+    CborError err = buf_append(&out->buf, data, len);
+    if (err == CborNoError && out->truncated) {
+        // not an allocation failure, but it makes cbor_value_to_pretty_stream() stop
+        err = CborErrorOutOfMemory;
+    }
+    return err;
+}
+
+STATIC size_t diag_format_uint(char *buffer, uint64_t value, unsigned base, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char reversed[20];
+    size_t len = 0;
+    do {
+        reversed[len++] = digits[value % base];
+        value /= base;
+    } while (value);
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = reversed[len - 1 - i];
+    }
+    return len;
+}
+
+// Splits the product of a and b into the rounded product and its rounding error, as by Dekker, since there is no fused
+// multiply-add to get the error from.
+STATIC void diag_two_product(double a, double b, double *product, double *error) {
+    double c = 134217729.0 * a; // 2^27 + 1 splits a double into two halves of 26 bits
+    double a_hi = c - (c - a);
+    double a_lo = a - a_hi;
+    c = 134217729.0 * b;
+    double b_hi = c - (c - b);
+    double b_lo = b - b_hi;
+    *product = a * b;
+    *error = ((a_hi * b_hi - *product) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo;
+}
+
+// Multiplies or divides the unevaluated sum hi + lo by power, a power of ten that is exact as a double, keeping what
+// hi can't hold in lo.
+STATIC void diag_scale(double *hi, double *lo, double power, bool divide) {
+    double product, error;
+    if (divide) {
+        // the remainder is taken of the halves, exactly, so that the product can't overflow near DBL_MAX
+        double quotient = *hi / power;
+        diag_two_product(quotient / 2, power, &product, &error);
+        *lo = ((*hi / 2 - product) - error + *lo / 2) / power * 2;
+        *hi = quotient;
+    } else {
+        diag_two_product(*hi, power, &product, &error);
+        *lo = error + *lo * power;
+        *hi = product;
+    }
+    double sum = *hi + *lo;
+    *lo -= sum - *hi;
+    *hi = sum;
+}
+
+// Formats a double like %.*g with a precision of 1 to 17, without allocating: the scaling by powers of ten carries its
+// rounding error along, so the digits are rounded once, from close to the exact value. At the precision of 17 that
+// cborpretty asks for, the text reads back to the same double.
+STATIC size_t diag_format_double(char *buffer, double value, int precision) {
+    char *p = buffer;
+    if (value != value) {
+        memcpy(p, "nan", 3);
+        return 3;
+    }
+    if (value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (value - value != 0) {
+        memcpy(p, "inf", 3);
+        return p + 3 - buffer;
+    }
+    if (value == 0) {
+        *p++ = '0';
+        return p - buffer;
+    }
+
+    // scale the value to precision integral digits, value = (hi + lo) * 10^exp10, by powers of ten up to 1e22, which
+    // are exact
+    double limit = 1;
+    for (int i = 0; i < precision; i++) {
+        limit *= 10;
+    }
+    double lo = 0;
+    int exp10 = 0;
+    while (value >= limit * 1e22) {
+        diag_scale(&value, &lo, 1e22, true);
+        exp10 += 22;
+    }
+    while (value < limit * 1e-23) {
+        diag_scale(&value, &lo, 1e22, false);
+        exp10 -= 22;
+    }
+    double power = 1;
+    int shift = 0;
+    while (value >= limit * power) {
+        power *= 10;
+        shift++;
+    }
+    if (shift) {
+        diag_scale(&value, &lo, power, true);
+        exp10 += shift;
+    } else {
+        while (value * power * 10 < limit) {
+            power *= 10;
+            shift++;
+        }
+        diag_scale(&value, &lo, power, false);
+        exp10 -= shift;
+    }
+    // split off the integral part; past 2^53 it is all in hi, and lo can hold whole units too
+    uint64_t mantissa;
+    double fraction;
+    while (1) {
+        mantissa = (uint64_t)value;
+        fraction = (value - (double)mantissa) + lo;
+        int64_t whole = (int64_t)fraction;
+        if ((double)whole > fraction) {
+            whole--;
+        }
+        mantissa += whole;
+        fraction -= (double)whole;
+        // the number of digits was picked by hi alone, which can be off by one next to a power of ten
+        if (mantissa < (uint64_t)limit / 10) {
+            diag_scale(&value, &lo, 10, false);
+            exp10--;
+        } else if (mantissa >= (uint64_t)limit) {
+            diag_scale(&value, &lo, 10, true);
+            exp10++;
+        } else {
+            break;
+        }
+    }
+    // then round it by the fraction, with ties to even like printf on an exact value
+    if (fraction > 0.5 || (fraction == 0.5 && (mantissa & 1))) {
+        mantissa++;
+    }
+    if (mantissa == (uint64_t)limit) {
+        mantissa /= 10;
+        exp10++;
+    }
+
+    char digits[20];
+    size_t n = diag_format_uint(digits, mantissa, 10, false);
+    // the decimal exponent of the leading digit picks fixed or exponent notation, as %g does
+    int exp = exp10 + (int)n - 1;
+    while (digits[n - 1] == '0') {
+        n--;
+    }
+
+    if (exp < -4 || exp >= precision) {
+        *p++ = digits[0];
+        if (n > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = exp < 0 ? '-' : '+';
+        if (exp < 0) {
+            exp = -exp;
+        }
+        if (exp < 10) {
+            *p++ = '0';
+        }
+        p += diag_format_uint(p, exp, 10, false);
+    } else if (exp < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        while (++exp < 0) {
+            *p++ = '0';
+        }
+        memcpy(p, digits, n);
+        p += n;
+    } else {
+        for (size_t i = 0; i <= (size_t)exp || i < n; i++) {
+            if (i == (size_t)exp + 1) {
+                *p++ = '.';
+            }
+            *p++ = i < n ? digits[i] : '0';
+        }
+    }
+    return p - buffer;
+}
+
+// The CborStreamFunction of diag(). Native modules have no vsnprintf(), so this formats the few conversions
+// cborpretty.c uses itself: %c, %s, %g and unsigned %u, %x and %X with an optional zero-padded width.
+STATIC CborError diag_printf(void *token, const char *fmt, ...) {
+    diag_out_t *out = token;
+    CborError err = CborNoError;
+    va_list ap;
+
+    va_start(ap, fmt);
+    while (*fmt != '\0' && err == CborNoError) {
+        const char *literal = fmt;
+        while (*fmt != '\0' && *fmt != '%') {
+            fmt++;
+        }
+        if (fmt != literal) {
+            err = diag_put(out, literal, fmt - literal);
+            continue;
+        }
+
+        // %[0][width][.precision][h|hh|l|ll]conversion
+        fmt++;
+        char pad = ' ';
+        size_t width = 0;
+        int precision = 6;
+        int longs = 0;
+        if (*fmt == '0') {
+            pad = '0';
+        }
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (*fmt++ - '0');
+        }
+        if (*fmt == '.') {
+            precision = 0;
+            while (*++fmt >= '0' && *fmt <= '9') {
+                precision = precision * 10 + (*fmt - '0');
+            }
+        }
+        while (*fmt == 'h') {
+            fmt++;
+        }
+        while (*fmt == 'l') {
+            longs++;
+            fmt++;
+        }
+
+        char conversion = *fmt++;
+        char buffer[32];
+        const char *str = buffer;
+        size_t len;
+        if (conversion == 's') {
+            str = va_arg(ap, const char *);
+            len = strlen(str);
+        } else if (conversion == 'c') {
+            buffer[0] = (char)va_arg(ap, int);
+            len = 1;
+        } else if (conversion == 'g') {
+            len = diag_format_double(buffer, va_arg(ap, double),
+                                     precision < 1 ? 1 : precision > 17 ? 17 : precision);
+        } else if (conversion == 'u' || conversion == 'x' || conversion == 'X') {
+            uint64_t value = longs == 2 ? va_arg(ap, unsigned long long) :
+                             longs == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            len = diag_format_uint(buffer, value, conversion == 'u' ? 10 : 16, conversion == 'X');
+        } else {
+            buffer[0] = conversion;
+            len = 1;
+        }
+
+        while (err == CborNoError && width > len) {
+            err = diag_put(out, &pad, 1);
+            width--;
+        }
+        if (err == CborNoError) {
+            err = diag_put(out, str, len);
+        }
+    }
+    va_end(ap);
+    return err;
+}
+
+// diag(buf, max_len=256) returns the CBOR item in buf in diagnostic notation (RFC 8949 section 8), such as
+// '{"a": [1, 2.5]}', without building the Python objects in between. Text longer than max_len characters, or None for
+// no limit, is cut short and ends in "...". Text strings are escaped, so the result is always ASCII.
+STATIC mp_obj_t cbor_diag(size_t n_args, const mp_obj_t *args, mp_map_t *kw_args) {
+    const qstr names[] = { MP_QSTR_max_len };
+    mp_obj_t opt[1];
+    get_optional_args(n_args, args, kw_args, 1, names, 1, opt);
+
+    mp_buffer_info_t bufinfo;
+    get_cbor_buffer(args[0], &bufinfo);
+
+    size_t max_len = opt[0] == mp_const_none ? SIZE_MAX : get_limit_arg(opt[0], DEFAULT_DIAG_LEN);
+    diag_out_t out = { { NULL, 0, 0 }, max_len, false };
+
+    CborParser parser;
+    CborValue it;
+    CborError err = cbor_parser_init(bufinfo.buf, bufinfo.len, 0, &parser, &it);
+    if (err == CborNoError) {
+        err = cbor_value_to_pretty_stream(diag_printf, &out, &it, CborPrettyDefaultFlags);
+    }
+    if (err == CborNoError && cbor_value_get_next_byte(&it) != (const uint8_t *)bufinfo.buf + bufinfo.len) {
+        err = CborErrorGarbageAtEnd;
+    }
+    if (out.truncated) {
+        // the item may well be invalid further on, but that's past what was asked for
+        if (out.max_len >= 3) {
+            memcpy(out.buf.data + out.buf.len - 3, "...", 3);
+        }
+    } else if (err != CborNoError) {
+        m_free(out.buf.data);
+        mp_raise_ValueError("parse error");
+    }
+
+    mp_obj_t result = mp_obj_new_str((const char *)out.buf.data, out.buf.len);
+    m_free(out.buf.data);
+    return result;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(cbor_loads_obj, 1, cbor_loads);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_dumps_obj, cbor_dumps);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_dumps_segments_obj, cbor_dumps_segments);
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(cbor_dump_obj, cbor_dump);
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(cbor_validate_obj, 1, cbor_validate);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_compact_obj, cbor_compact);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_to_json_obj, cbor_to_json);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_from_json_obj, cbor_from_json);
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(cbor_diag_obj, 1, cbor_diag);
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(cbor_extract_obj, cbor_extract);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_index_obj, cbor_index);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(cbor_index_get_obj, 2, 3, cbor_index_get);
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(cbor_view_obj, cbor_view);
+
+STATIC mp_map_elem_t cbor_index_locals_dict_table[1];
+STATIC MP_DEFINE_CONST_DICT(cbor_index_locals_dict, cbor_index_locals_dict_table);
+
+// This is the entry point and is called when the module is imported
+mp_obj_t mpy_init(mp_obj_fun_bc_t *self, size_t n_args, size_t n_kw, mp_obj_t *args) {
+    MP_DYNRUNTIME_INIT_ENTRY
+
+    encode_handlers_init();
+
+    mp_store_global(MP_QSTR_loads, MP_OBJ_FROM_PTR(&cbor_loads_obj));
+    mp_store_global(MP_QSTR_dumps, MP_OBJ_FROM_PTR(&cbor_dumps_obj));
+    mp_store_global(MP_QSTR_dump, MP_OBJ_FROM_PTR(&cbor_dump_obj));
+    mp_store_global(MP_QSTR_dumps_segments, MP_OBJ_FROM_PTR(&cbor_dumps_segments_obj));
+    mp_store_global(MP_QSTR_validate, MP_OBJ_FROM_PTR(&cbor_validate_obj));
+    mp_store_global(MP_QSTR_compact, MP_OBJ_FROM_PTR(&cbor_compact_obj));
+    mp_store_global(MP_QSTR_to_json, MP_OBJ_FROM_PTR(&cbor_to_json_obj));
+    mp_store_global(MP_QSTR_from_json, MP_OBJ_FROM_PTR(&cbor_from_json_obj));
+    mp_store_global(MP_QSTR_diag, MP_OBJ_FROM_PTR(&cbor_diag_obj));
+    mp_store_global(MP_QSTR_extract, MP_OBJ_FROM_PTR(&cbor_extract_obj));
+    mp_store_global(MP_QSTR_index, MP_OBJ_FROM_PTR(&cbor_index_obj));
+    mp_store_global(MP_QSTR_view, MP_OBJ_FROM_PTR(&cbor_view_obj));
+
+    // types can't be constant in a native module, so the view types are filled in here
+    cbor_index_type.base.type = (void *)&mp_type_type;
+    cbor_index_type.name = MP_QSTR_MapIndex;
+    cbor_index_type.subscr = cbor_index_subscr;
+    cbor_index_type.binary_op = cbor_index_binary_op;
+    cbor_index_locals_dict_table[0] = (mp_map_elem_t){ MP_OBJ_NEW_QSTR(MP_QSTR_get), MP_OBJ_FROM_PTR(&cbor_index_get_obj) };
+    cbor_index_type.locals_dict = (void *)&cbor_index_locals_dict;
+    cbor_view_type.base.type = (void *)&mp_type_type;
+    cbor_view_type.name = MP_QSTR_View;
+    cbor_view_type.subscr = cbor_view_subscr;
+    cbor_view_type.unary_op = cbor_view_unary_op;
 
     MP_DYNRUNTIME_INIT_EXIT
 }
@@ -19,4 +19,25 @@ def encode_cbor(d):
 
 @timed_function
 def encode_json(d):
-	return json.dumps(d)
\ No newline at end of file
+	return json.dumps(d)
+
+@timed_function
+def decode_cbor(b):
+	return ucbor.loads(b)
+
+@timed_function
+def decode_json(s):
+	return json.loads(s)
+
+@timed_function
+def validate_cbor(b):
+	return ucbor.validate(b)
+
+def run():
+	# many small items, so the time is dominated by parsing each initial byte
+	d = {"ints": list(range(-500, 500)), "flags": [True, False, None] * 100, "names": ["abc"] * 300}
+	b = encode_cbor(d)
+	decode_cbor(b)
+	decode_json(encode_json(d))
+	# the parser alone, without building objects
+	validate_cbor(b)
\ No newline at end of file
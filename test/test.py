@@ -9,6 +9,8 @@ def run():
         "bytes": (b'Cabc', b"abc"),
         "float64": (b'\xfb@\t\x1e\xb8Q\xeb\x85\x1f', 3.14),
         "float32": (b'\xfa@H\xf5\xc3', 3.14),
+        "float16": (b'\xf9>\x00', 1.5),
+        "float16_subnormal": (b'\xf9\x80\x01', -5.960464477539063e-08),
         "list": (b'\x83\x01\x02\x03', [1, 2, 3]),
         "nested_list": (b'\x83\x83\x82\x01\x02\x82\x03\x04\x05\x06\x07', [[[1,2], [3, 4], 5], 6, 7]),
         "dict": (b'\xa2dabcdcefgdhijkelmnop', {"hijk": "lmnop", "abcd": "efg"}),
@@ -35,4 +37,384 @@ def run():
 
     print("check tuple encodes to array")
     assert ucbor.dumps((1, 2, 3)) == b'\x83\x01\x02\x03'
-    print("success")
\ No newline at end of file
+    print("success")
+
+    print("check encoder types")
+    assert ucbor.dumps([True, False, None]) == b'\x83\xf5\xf4\xf6'
+    assert ucbor.dumps(bytearray(b'ab')) == b'Bab'
+    assert ucbor.dumps(memoryview(b'abc')[1:]) == b'Bbc'
+    assert ucbor.dumps("\u00e9") == b'b\xc3\xa9'
+
+    class D(dict):
+        pass
+
+    class L(list):
+        pass
+
+    d = D()
+    d["a"] = L([1, 2])
+    assert ucbor.dumps(d) == b'\xa1aa\x82\x01\x02'
+    from array import array
+    assert ucbor.dumps(array('b', [1, -1])) == b'B\x01\xff'
+    assert ucbor.dumps(array('B')) == b'@'
+
+    class Plain:
+        pass
+
+    class Empty(Plain):
+        def __len__(self):
+            return 0
+
+    for bad in (object(), Plain(), Empty()):
+        try:
+            ucbor.dumps(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check iterables")
+    assert ucbor.dumps(x for x in (1, 2)) == b'\x9f\x01\x02\xff'
+    assert ucbor.dumps(range(3)) == b'\x9f\x00\x01\x02\xff'
+    assert ucbor.loads(ucbor.dumps([x for x in range(100)])) == list(range(100))
+
+    class M:
+        def items(self):
+            return iter((("a", 1),))
+
+        def __iter__(self):
+            return iter(("a",))
+
+    assert ucbor.dumps(M()) == b'\xbfaa\x01\xff'
+
+    class It:
+        def __iter__(self):
+            return iter((1, 2))
+
+    class SubIt(It):
+        pass
+
+    assert ucbor.dumps(SubIt()) == b'\x9f\x01\x02\xff'
+    print("success")
+
+    print("check validate")
+    assert ucbor.validate(b'\xa2aa\x01ab\x02')
+    assert ucbor.validate(b'\xa2aa\x01ab\x02', "strict")
+    assert not ucbor.validate(b'\xa2aa\x01aa\x02', mode="strict")
+    assert not ucbor.validate(b'\x82\x01')
+    assert not ucbor.validate(b'\x01\x01')
+    assert not ucbor.validate(b'b\xc3(', "strict")
+    assert not ucbor.validate(b'\x9f\x01\xff', "canonical")
+    assert not ucbor.validate(b'\x9f\x01\xff', "strict")
+    assert ucbor.validate(b'\xa2\x01\x01\x18\x01\x02', "strict")
+    assert ucbor.validate(b'\xf0')
+    assert ucbor.validate(b'\xa2ab\x01aa\x02', "strict")
+    assert not ucbor.validate(b'\xa2ab\x01aa\x02', "canonical")
+    assert not ucbor.validate(b'\xbfaa\x01ab\x02aa\x03\xff', "strict")
+    assert not ucbor.validate(b'b\xc3(', "canonical")
+    assert not ucbor.validate(b'\xa2aa\x01aa\x02', "canonical")
+    assert ucbor.validate(b'\xa2aa\x01ab\x02', "canonical")
+    print("success")
+
+    print("check strict loads")
+    assert ucbor.loads(b'\xa2aa\x01ab\x02', strict=True) == {"a": 1, "b": 2}
+    assert ucbor.loads(b'\xa2aa\x01aa\x02') == {"a": 2}
+    for bad in (b'\xa2aa\x01aa\x02', b'b\xc3(', b'\x01\x01', b'\x82\x01\x02\x00'):
+        try:
+            ucbor.loads(bad, strict=True)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check UTF-8 validation")
+
+    def text(b):
+        # encode as a byte string, then switch major type 2 to 3
+        enc = ucbor.dumps(b)
+        return bytes([enc[0] + 0x20]) + enc[1:]
+
+    good = (
+        "\u00e9" * 40,
+        "a\u00e9\u20ac\U0001f600" * 10,
+        "a" * 15 + "\u00e9" + "a" * 20,
+        "a" * 30 + "\u20ac" + "a" * 20,
+        "a" * 29 + "\U0001f600" * 3,
+    )
+    for s in good:
+        assert ucbor.loads(text(s.encode()), strict=True) == s
+        assert ucbor.validate(text(s.encode()), "strict")
+    # invalid sequences straddling or just past the 16 and 32 byte blocks
+    bad = (
+        b"a" * 15 + b"\xc3(" + b"a" * 20,
+        b"a" * 31 + b"\xe2\x82" + b"a" * 5,
+        b"a" * 16 + b"\x80" + b"a" * 20,
+        b"\xc3\xa9" * 20 + b"\xed\xa0\x80" + b"a" * 10,
+        b"\xc3\xa9" * 20 + b"\xf0\x9f\x98",
+        b"\xc3\xa9" * 8 + b"\xc0\xaf" + b"\xc3\xa9" * 8,
+        b"a" * 14 + b"\xf4\x90\x80\x80" + b"a" * 20,
+    )
+    for b in bad:
+        assert not ucbor.validate(text(b), "strict")
+        try:
+            ucbor.loads(text(b), strict=True)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check dump")
+
+    class Sink:
+        def __init__(self):
+            self.parts = []
+
+        def write(self, b):
+            self.parts.append(bytes(b))
+            return len(b)
+
+    obj = {"a": list(range(100)), "b": b"x" * 1000, "c": "y"}
+    sink = Sink()
+    ucbor.dump(obj, sink)
+    assert b"".join(sink.parts) == ucbor.dumps(obj)
+    assert len(sink.parts) < 10
+    sink = Sink()
+    ucbor.dump(1, sink)
+    assert sink.parts == [b'\x01']
+
+    class Keeper:
+        def __init__(self):
+            self.parts = []
+
+        def write(self, b):
+            self.parts.append(b)
+            return len(b)
+
+    keeper = Keeper()
+    ucbor.dump(obj, keeper)
+    assert b"".join(bytes(p) for p in keeper.parts) == ucbor.dumps(obj)
+    try:
+        keeper.parts[0][0] = 0
+        assert False
+    except TypeError:
+        pass
+
+    class Stalled:
+        def write(self, b):
+            return None
+
+    try:
+        ucbor.dump(obj, Stalled())
+        assert False
+    except OSError:
+        pass
+    print("success")
+
+    print("check dumps_segments")
+    frame = b"f" * 1000
+    obj = {"frame": frame, "n": list(range(50)), "s": "t" * 300}
+    segs = ucbor.dumps_segments(obj)
+    assert b"".join(bytes(s) for s in segs) == ucbor.dumps(obj)
+    assert any(len(s) == 1000 and bytes(s) == frame for s in segs)
+    assert [bytes(s) for s in ucbor.dumps_segments([1, "a"])] == [b'\x82\x01aa']
+    print("success")
+
+    print("check compact")
+    assert ucbor.compact(b'\x9f\x01\xbfaa\x7fab\x62cd\xff\xff\xff') == b'\x82\x01\xa1aa\x63bcd'
+    assert ucbor.compact(b'\xc1\x9f\xff') == b'\xc1\x80'
+    assert ucbor.compact(b'\x98\x01\x01') == b'\x81\x01'
+    buf = b'\x82\x01\x02'
+    assert ucbor.compact(buf) is buf
+    big = ucbor.dumps(x for x in range(30))
+    assert ucbor.compact(big) == ucbor.dumps(list(range(30)))
+    many = ucbor.dumps([iter((i,)) for i in range(20)])
+    assert ucbor.compact(many) == ucbor.dumps([[i] for i in range(20)])
+    deep = b'\x9f' * 2000 + b'\xff' * 2000
+    for bad in (b'\x9f\x01', b'\x01\x01', b'\x7f\x01\xff', deep, b'\x9f\x9f\x01', b'\xc1\x9f\x01', b'\xbf\x61a'):
+        try:
+            ucbor.compact(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check to_json")
+    assert ucbor.to_json(ucbor.dumps({"a": [1, 2.5, None, True]})) == '{"a":[1,2.5,null,true]}'
+    assert ucbor.to_json(b'\x43\x00\x01\x02') == '"AAEC"'
+    assert ucbor.to_json(ucbor.dumps('q"\\\n\x01\u00e9')) == '"q\\"\\\\\\n\\u0001\u00e9"'
+    assert ucbor.to_json(b'\x3b\xff\xff\xff\xff\xff\xff\xff\xff') == "-18446744073709551616"
+    assert ucbor.to_json(b'\xf9\x7c\x00') == "null"
+    for bad in (b'\xa1\x01\x02', b'\x62\xc3\x28', b'\x01\x01', b'\x82\x01'):
+        try:
+            ucbor.to_json(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check from_json")
+    assert ucbor.from_json('{"a": [1, -2, true, null], "b": "x\\n\\u00e9"}') == b'\xbfaa\x9f\x01\x21\xf5\xf6\xffab\x64x\n\xc3\xa9\xff'
+    assert ucbor.loads(ucbor.from_json(' [0.5, 1e2, 18446744073709551615] ')) == [0.5, 100.0, 2**64 - 1]
+    assert ucbor.compact(ucbor.from_json('{"a": []}')) == b'\xa1aa\x80'
+    for bad in ('', '[1,]', '{"a"}', '01', '"\\ud800"', '[1] 2', '{1: 2}'):
+        try:
+            ucbor.from_json(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check diag")
+    assert ucbor.diag(b'\xa1aa\x82\x01\xfb\x40\x04' + bytes(6)) == '{"a": [1, 2.5]}'
+    assert ucbor.diag(b'\x9fC\x01\x02\x03b\xc3\xa9\xf6\xc1\x1a\x5f\x5e\x10\x00\xff') == '[_ h\'010203\', "\\u00E9", null, 1(1600000000)]'
+    buf = ucbor.dumps(list(range(100)))
+    text = ucbor.diag(buf)
+    assert len(text) == 256 and text.startswith("[0, 1, 2, ") and text.endswith("...")
+    assert ucbor.diag(buf, max_len=10) == "[0, 1, ..."
+    assert ucbor.diag(buf, max_len=None) == str(list(range(100)))
+    assert ucbor.diag(b'\x82\x01\x02\x00', max_len=3) == "..."
+    assert ucbor.diag(b'\xfb\x40\x67\xe4\x4a\x5e\x64\x1c\x9a') == "191.13407821229049"
+    assert ucbor.diag(b'\xfb\x7f\xef' + b'\xff' * 6) == "1.7976931348623157e+308"
+    # 0.1 + 0.2 and 2**-1074 print differently from their neighbours
+    assert ucbor.diag(b'\xfb\x3f\xd3\x33\x33\x33\x33\x33\x34') == "0.30000000000000004"
+    assert ucbor.diag(b'\xfb\x3f\xd3\x33\x33\x33\x33\x33\x33') == "0.29999999999999999"
+    assert ucbor.diag(b'\xfb' + bytes(7) + b'\x01') == "4.9406564584124654e-324"
+    assert ucbor.diag(b'\xfb' + bytes(7) + b'\x02') == "9.8813129168249309e-324"
+    for bad in (b'\x82\x01', b'\x01\x01', b'\x62\xc3'):
+        try:
+            ucbor.diag(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check index")
+    ix = ucbor.index(b'\xa3aa\x01ab\x82\x02\x03\x7fac\x61d\xff\x04')
+    assert ix["a"] == 1
+    assert ix["b"] == [2, 3]
+    assert ix["cd"] == 4
+    assert "a" in ix and "z" not in ix and 1 not in ix
+    assert ix.get("z") is None and ix.get("z", 5) == 5
+    try:
+        ix["z"]
+        assert False
+    except KeyError:
+        pass
+    for bad in (b'\x82\x01\x02', b'\xa2aa\x01'):
+        try:
+            ucbor.index(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check extract")
+    buf = b'\xa4aa\x01ab\x82\x02\x03\x7fac\x61d\xff\x04aa\x05'
+    assert ucbor.extract(buf, ("b", "cd", "z", "a")) == ([2, 3], 4, None, 1)
+    assert ucbor.extract(buf, []) == ()
+    buf = b'\xa3\x63a\x00b\x01\x61a\x02\x7f\x61c\x62\x00d\xff\x03'
+    assert ucbor.extract(buf, ("a\x00b", "a", "c\x00d", "a\x00")) == (1, 2, 3, None)
+    try:
+        ucbor.extract(b'\x82\x01\x02', ("a",))
+        assert False
+    except ValueError:
+        pass
+    print("success")
+
+    print("check view")
+    data = [1, "two", [3, [4]], {"k": [5, 6], "x": None}, b"\x07", 2**70]
+    v = ucbor.view(ucbor.dumps(data))
+    assert len(v) == 6
+    assert v[0] == 1 and v[1] == "two" and v[-2] == b"\x07" and v[5] == 2**70
+    assert len(v[2]) == 2 and v[2][1][0] == 4 and v[2][-1][-1] == 4
+    assert len(v[3]) == 2 and v[3]["k"][1] == 6 and v[3]["x"] is None
+    for bad in (6, -7):
+        try:
+            v[bad]
+            assert False
+        except IndexError:
+            pass
+    try:
+        v[3]["z"]
+        assert False
+    except KeyError:
+        pass
+    # indefinite lengths, a chunked key, a tagged key, a key with a NUL and a repeated key
+    v = ucbor.view(b'\xbf\x7f\x61a\x61b\xff\x9f\x01\x02\xff\xc0\x61c\x03\x62d\x00\x04\x62ab\x05\xff')
+    assert len(v) == 4 and len(v["ab"]) == 2 and v["ab"][1] == 2
+    assert v["c"] == 3 and v["d\x00"] == 4
+    assert ucbor.view(bytearray(b'\x82\x01\x02'))[1] == 2
+    for bad in (b'\x01', b'\x82\x01', b'\x9f\x01'):
+        try:
+            ucbor.view(bad)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check limits")
+    assert ucbor.loads(b'\x81\x81\x81\x01', max_depth=3) == [[[1]]]
+    assert ucbor.loads(b'\x83\x01\x02\x03', max_items=4) == [1, 2, 3]
+    assert ucbor.loads(b'cabc', max_string_len=3, max_total_alloc=3) == "abc"
+    assert ucbor.loads(b'\x81' * 32 + b'\x01', max_depth=None)[0][0][0] is not None
+    assert ucbor.validate(b'\x81' * 20 + b'\x01')
+    # nesting is capped at 32 levels by the module build, whatever max_depth says
+    deep = b'\x81' * 40 + b'\x01'
+    assert not ucbor.validate(deep)
+    for f in (ucbor.compact, ucbor.to_json, ucbor.diag):
+        try:
+            f(deep)
+            assert False
+        except ValueError:
+            pass
+    try:
+        ucbor.from_json("[" * 40 + "]" * 40)
+        assert False
+    except ValueError:
+        pass
+    for bad, kwargs in (
+        (b'\x81\x81\x81\x01', {"max_depth": 2}),
+        (b'\x81' * 33 + b'\x01', {}),
+        (b'\x81' * 33 + b'\x01', {"max_depth": None}),
+        (b'\x81' * 33 + b'\x01', {"max_depth": 1000}),
+        (b'\x83\x01\x02\x03', {"max_items": 3}),
+        (b'\x9f\x01\x02\x03\xff', {"max_items": 3}),
+        (b'cabc', {"max_string_len": 2}),
+        (b'\x7fa\x61bc\xff', {"max_string_len": 2}),
+        (b'cabc', {"max_total_alloc": 2}),
+        (b'\x9b\x00\x00\x00\x01\x00\x00\x00\x00', {}),
+        (b'\xba\x40\x00\x00\x00', {}),
+        (b'\x7a\xff\xff\xff\xff', {}),
+    ):
+        try:
+            ucbor.loads(bad, **kwargs)
+            assert False
+        except ValueError:
+            pass
+    print("success")
+
+    print("check big ints")
+    ints = (
+        (2**32, b'\x1b\x00\x00\x00\x01\x00\x00\x00\x00'),
+        (2**64 - 1, b'\x1b\xff\xff\xff\xff\xff\xff\xff\xff'),
+        (-2**64, b'\x3b\xff\xff\xff\xff\xff\xff\xff\xff'),
+        (-2**31 - 1, b'\x3a\x80\x00\x00\x00'),
+        (2**64, b'\xc2\x49\x01' + bytes(8)),
+        (-2**64 - 1, b'\xc3\x49\x01' + bytes(8)),
+    )
+    for val, enc in ints:
+        assert ucbor.dumps(val) == enc
+        assert ucbor.loads(enc) == val
+    # sizes around powers of two, and past the range of a float
+    for bits in (63, 64, 65, 127, 128, 129, 1023, 1024, 1025, 3000):
+        for val in (2**bits - 1, 2**bits, -2**bits, -2**bits - 1):
+            assert ucbor.loads(ucbor.dumps(val)) == val
+    assert ucbor.dumps(2**1024) == b'\xc2\x58\x81\x01' + bytes(128)
+    assert ucbor.loads(b'\xc2\x42\x01\x00') == 256
+    assert ucbor.loads(b'\xc3\x40') == -1
+    try:
+        ucbor.loads(b'\xc2\x01')
+        assert False
+    except ValueError:
+        pass
+    print("success")
@@ -192,10 +192,11 @@ typedef enum CborError {
     CborErrorUnsupportedType,
     CborErrorUnimplementedValidation,
 
-    /* errors in converting to JSON */
+    /* errors in converting to and from JSON */
     CborErrorJsonObjectKeyIsAggregate = 1280,
     CborErrorJsonObjectKeyNotString,
     CborErrorJsonNotImplemented,
+    CborErrorJsonSyntax,
 
     CborErrorOutOfMemory = (int) (~0U / 2 + 1),
     CborErrorInternalError = (int) (~0U / 2)    /* INT_MAX on two's complement machines */
@@ -216,9 +217,19 @@ typedef CborError (*CborEncoderWriteFunction)(void *, const void *, size_t, Cbor
 enum CborEncoderFlags
 {
     CborIteratorFlag_WriterFunction         = 0x01,
+    CborIteratorFlag_StagedWriter           = 0x02,
     CborIteratorFlag_ContainerIsMap_        = 0x20
 };
 
+typedef struct CborEncoderStage
+{
+    CborEncoderWriteFunction writer;
+    void *token;
+    uint8_t *buffer;
+    size_t size;
+    size_t used;
+} CborEncoderStage;
+
 struct CborEncoder
 {
     union {
@@ -237,6 +248,12 @@ static const size_t CborIndefiniteLength = SIZE_MAX;
 #ifndef CBOR_NO_ENCODER_API
 CBOR_API void cbor_encoder_init(CborEncoder *encoder, uint8_t *buffer, size_t size, int flags);
 CBOR_API void cbor_encoder_init_writer(CborEncoder *encoder, CborEncoderWriteFunction writer, void *);
+CBOR_API void cbor_encoder_init_staged_writer(CborEncoder *encoder, CborEncoderStage *stage,
+                                              CborEncoderWriteFunction writer, void *token,
+                                              uint8_t *buffer, size_t size);
+CBOR_API CborError cbor_encoder_flush(CborEncoder *encoder);
+CBOR_INLINE_API CborEncoderStage *cbor_encoder_get_stage(const CborEncoder *encoder)
+{ return encoder->flags & CborIteratorFlag_StagedWriter ? (CborEncoderStage *)encoder->end : NULL; }
 CBOR_API CborError cbor_encode_uint(CborEncoder *encoder, uint64_t value);
 CBOR_API CborError cbor_encode_int(CborEncoder *encoder, int64_t value);
 CBOR_API CborError cbor_encode_negative_int(CborEncoder *encoder, uint64_t absolute_value);
@@ -349,7 +366,9 @@ typedef struct CborValue CborValue;
 
 #ifndef CBOR_NO_PARSER_API
 CBOR_API CborError cbor_parser_init(const uint8_t *buffer, size_t size, uint32_t flags, CborParser *parser, CborValue *it);
+#if !defined(CBOR_PARSER_READER_CONTROL) || CBOR_PARSER_READER_CONTROL >= 0
 CBOR_API CborError cbor_parser_init_reader(const struct CborParserOperations *ops, CborParser *parser, CborValue *it, void *token);
+#endif
 
 CBOR_API CborError cbor_value_validate_basic(const CborValue *it);
 
@@ -555,6 +574,21 @@ CBOR_INLINE_API CborError cbor_value_get_byte_string_chunk(const CborValue *valu
     return _cbor_value_get_string_chunk(value, (const void **)bufferptr, len, next);
 }
 
+CBOR_PRIVATE_API CborError _cbor_value_get_string_span(const CborValue *value, const void **bufferptr,
+                                                       size_t *len, CborValue *next);
+CBOR_INLINE_API CborError cbor_value_get_text_string_span(const CborValue *value, const char **bufferptr,
+                                                          size_t *len, CborValue *next)
+{
+    assert(cbor_value_is_text_string(value));
+    return _cbor_value_get_string_span(value, (const void **)bufferptr, len, next);
+}
+CBOR_INLINE_API CborError cbor_value_get_byte_string_span(const CborValue *value, const uint8_t **bufferptr,
+                                                          size_t *len, CborValue *next)
+{
+    assert(cbor_value_is_byte_string(value));
+    return _cbor_value_get_string_span(value, (const void **)bufferptr, len, next);
+}
+
 CBOR_API CborError cbor_value_text_string_equals(const CborValue *value, const char *string, bool *result);
 
 /* Maps and arrays */
@@ -590,6 +624,37 @@ CBOR_INLINE_API CborError cbor_value_get_map_length(const CborValue *value, size
 }
 
 CBOR_API CborError cbor_value_map_find_value(const CborValue *map, const char *string, CborValue *element);
+CBOR_API CborError cbor_value_map_find_values(const CborValue *map, const char *const *strings, const size_t *lengths,
+                                              size_t count, CborValue *elements);
+
+typedef struct CborMapIndexEntry
+{
+    const uint8_t *key;     /* points into the parser's buffer; NULL for an empty slot */
+    size_t keyLength;
+    uint32_t hash;
+    CborValue value;
+} CborMapIndexEntry;
+
+typedef struct CborMapIndex
+{
+    CborMapIndexEntry *entries;
+    size_t mask;
+    size_t count;
+    CborValue map;
+    bool complete;          /* false if some text string keys were chunked and left out */
+} CborMapIndex;
+
+CBOR_API CborError cbor_map_index_build(const CborValue *map, CborMapIndex *index,
+                                        CborMapIndexEntry *entries, size_t capacity);
+CBOR_API CborError cbor_map_index_find(const CborMapIndex *index, const char *key, size_t len,
+                                       CborValue *element);
+CBOR_INLINE_API size_t cbor_map_index_capacity(size_t pairs)
+{
+    size_t capacity = 8;
+    while (capacity < pairs * 2)
+        capacity *= 2;
+    return capacity;
+}
 
 /* Floating point */
 CBOR_INLINE_API bool cbor_value_is_half_float(const CborValue *value)
@@ -658,7 +723,7 @@ enum CborValidationFlags {
     CborValidateNoUndefined                 = 0x200000,
     CborValidateNoTags                      = 0x400000,
     CborValidateFiniteFloatingPoint         = 0x800000,
-    /* unused                               = 0x1000000, */
+    CborValidateMapKeysAreDistinct          = 0x1000000,
     /* unused                               = 0x2000000, */
 
     CborValidateNoUnknownSimpleTypesSA      = 0x4000000,
@@ -674,8 +739,64 @@ enum CborValidationFlags {
 };
 
 CBOR_API CborError cbor_value_validate(const CborValue *it, uint32_t flags);
+CBOR_API CborError cbor_validate_utf8(const void *ptr, size_t n);
 #endif /* CBOR_NO_VALIDATION_API */
 
+/* Definite-length compaction API */
+#ifndef CBOR_NO_COMPACT_API
+
+typedef struct CborCompactor
+{
+    size_t *lengths;        /* lengths of the indefinite-length items, in stream order */
+    size_t capacity;
+    size_t count;
+    size_t size;            /* size of the compacted item */
+} CborCompactor;
+
+CBOR_API void cbor_compactor_init(CborCompactor *compactor, size_t *lengths, size_t capacity);
+CBOR_API CborError cbor_compactor_scan(CborCompactor *compactor, CborValue *it);
+CBOR_API CborError cbor_compactor_write(const CborCompactor *compactor, CborValue *it, uint8_t *out);
+#endif /* CBOR_NO_COMPACT_API */
+
+/* Structural index (tape) API */
+#ifndef CBOR_NO_TAPE_API
+
+typedef struct CborTapeEntry
+{
+    uint32_t offset;        /* first byte of the item */
+    uint32_t next;          /* index of the entry after this item's subtree */
+    uint32_t children;      /* arrays and maps: their block in CborTape::children */
+} CborTapeEntry;
+
+typedef struct CborTape
+{
+    const uint8_t *begin;
+    const uint8_t *end;
+    CborTapeEntry *entries;
+    uint32_t *children;     /* per container: the number of children, then their entries */
+    size_t capacity;
+    size_t childCapacity;
+    size_t count;
+    size_t childCount;
+} CborTape;
+
+CBOR_API void cbor_tape_init(CborTape *tape, CborTapeEntry *entries, size_t capacity,
+                             uint32_t *children, size_t childCapacity);
+CBOR_API CborError cbor_tape_build(CborTape *tape, CborValue *it);
+CBOR_API CborType cbor_tape_get_type(const CborTape *tape, size_t index);
+CBOR_API CborError cbor_tape_value_at(const CborTape *tape, size_t index, CborParser *parser, CborValue *it);
+
+CBOR_INLINE_API size_t cbor_tape_skip(const CborTape *tape, size_t index)
+{ return tape->entries[index].next; }
+CBOR_INLINE_API size_t cbor_tape_get_count(const CborTape *tape, size_t index)
+{ return tape->children[tape->entries[index].children]; }
+CBOR_INLINE_API size_t cbor_tape_child(const CborTape *tape, size_t index, size_t n)
+{
+    assert(n < cbor_tape_get_count(tape, index));
+    return tape->children[tape->entries[index].children + 1 + n];
+}
+#endif /* CBOR_NO_TAPE_API */
+
 /* Human-readable (dump) API */
 #ifndef CBOR_NO_PRETTY_API
 
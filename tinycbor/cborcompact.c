@@ -0,0 +1,285 @@
+/****************************************************************************
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+**
+****************************************************************************/
+
+#ifndef _BSD_SOURCE
+#define _BSD_SOURCE 1
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+#ifndef __STDC_LIMIT_MACROS
+#  define __STDC_LIMIT_MACROS 1
+#endif
+
+#include "cbor.h"
+#include "cborinternal_p.h"
+#include "compilersupport_p.h"
+
+#include <string.h>
+
+/**
+ * \defgroup CborCompact Definite-length compaction
+ * \brief Group of functions used to rewrite indefinite-length items with
+ * their lengths
+ *
+ * Streaming encoders emit arrays and maps of unknown length, terminated by a
+ * break byte, and strings split into chunks. Compaction rewrites such an item
+ * so that every array, map and string nested in it carries its length, which
+ * is cheaper to decode and lets a decoder check lengths before allocating.
+ * Everything else is copied unchanged, except that the length of definite
+ * arrays and maps is rewritten in its shortest form.
+ *
+ * It takes two linear passes over an item held in memory. The first,
+ * cbor_compactor_scan(), records the lengths of the indefinite-length items
+ * in stream order and the size of the result. The second,
+ * cbor_compactor_write(), writes the result.
+ *
+ * The result can't be written over the source: the header of an array that
+ * had an unknown length may be longer than the byte it replaces, and it has
+ * to be written before the elements are read.
+ */
+
+/**
+ * \addtogroup CborCompact
+ * @{
+ */
+
+static size_t header_size(uint64_t value)
+{
+    if (value < Value8Bit)
+        return 1;
+    if (value <= UINT8_MAX)
+        return 2;
+    if (value <= UINT16_MAX)
+        return 3;
+    if (value <= UINT32_MAX)
+        return 5;
+    return 9;
+}
+
+static uint8_t *put_header(uint8_t *out, uint8_t majorType, uint64_t value)
+{
+    size_t size = header_size(value);
+    size_t i;
+
+    if (size == 1) {
+        *out = majorType | (uint8_t)value;
+        return out + 1;
+    }
+
+    /* sizes 2, 3, 5 and 9 select Value8Bit to Value64Bit */
+    out[0] = majorType | (uint8_t)(Value8Bit + (size > 2) + (size > 3) + (size > 5));
+    for (i = size - 1; i > 0; --i) {
+        out[i] = (uint8_t)value;
+        value >>= 8;
+    }
+    return out + size;
+}
+
+/* Walks the chunks of the string \a it points to, leaving \a it after the
+ * string. The chunks are appended to \a out, unless it is null. */
+static CborError walk_chunks(CborValue *it, uint8_t **out, size_t *total)
+{
+    CborError err = cbor_value_begin_string_iteration(it);
+
+    *total = 0;
+    while (!err) {
+        const void *chunk;
+        size_t len;
+        err = _cbor_value_get_string_chunk(it, &chunk, &len, it);
+        if (err == CborErrorNoMoreStringChunks)
+            return cbor_value_finish_string_iteration(it);
+        if (err)
+            return err;
+        if (add_check_overflow(*total, len, total))
+            return CborErrorDataTooLarge;
+        if (out && len) {
+            memcpy(*out, chunk, len);
+            *out += len;
+        }
+    }
+    return err;
+}
+
+static CborError scan_item(CborCompactor *compactor, CborValue *it, int recursionLeft, size_t *size)
+{
+    CborError err;
+    CborType type = cbor_value_get_type(it);
+    const uint8_t *begin = cbor_value_get_next_byte(it);
+
+    if (!recursionLeft)
+        return CborErrorNestingTooDeep;
+
+    if (type == CborTagType) {
+        size_t tagSize;
+        err = cbor_value_advance_fixed(it);
+        if (err)
+            return err;
+        tagSize = (size_t)(cbor_value_get_next_byte(it) - begin);
+        err = scan_item(compactor, it, recursionLeft - 1, size);
+        if (err)
+            return err;
+        *size += tagSize;
+        return CborNoError;
+    }
+
+    if (type == CborArrayType || type == CborMapType) {
+        CborValue recursed;
+        size_t slot = compactor->count;
+        size_t n = 0;
+        size_t total = 0;
+        bool indefinite = !cbor_value_is_length_known(it);
+
+        if (indefinite)
+            ++compactor->count;
+
+        err = cbor_value_enter_container(it, &recursed);
+        while (!err && !cbor_value_at_end(&recursed)) {
+            size_t childSize;
+            err = scan_item(compactor, &recursed, recursionLeft - 1, &childSize);
+            if (err)
+                break;
+            total += childSize;
+            ++n;
+        }
+        if (!err)
+            err = cbor_value_leave_container(it, &recursed);
+        if (err)
+            return err;
+
+        if (type == CborMapType)
+            n /= 2;
+        if (indefinite && slot < compactor->capacity)
+            compactor->lengths[slot] = n;
+        *size = header_size(n) + total;
+        return CborNoError;
+    }
+
+    if ((type == CborByteStringType || type == CborTextStringType) && !cbor_value_is_length_known(it)) {
+        size_t len;
+        err = walk_chunks(it, NULL, &len);
+        if (err)
+            return err;
+        if (compactor->count < compactor->capacity)
+            compactor->lengths[compactor->count] = len;
+        ++compactor->count;
+        *size = header_size(len) + len;
+        return CborNoError;
+    }
+
+    err = cbor_value_advance(it);
+    *size = (size_t)(cbor_value_get_next_byte(it) - begin);
+    return err;
+}
+
+static CborError write_item(const CborCompactor *compactor, size_t *slot, CborValue *it, uint8_t **out)
+{
+    CborError err;
+    CborType type = cbor_value_get_type(it);
+    const uint8_t *begin = cbor_value_get_next_byte(it);
+    size_t len;
+
+    if (type == CborArrayType || type == CborMapType) {
+        CborValue recursed;
+        if (!cbor_value_is_length_known(it)) {
+            len = compactor->lengths[(*slot)++];
+        } else {
+            err = type == CborArrayType ? cbor_value_get_array_length(it, &len) : cbor_value_get_map_length(it, &len);
+            if (err)
+                return err;
+        }
+        *out = put_header(*out, (uint8_t)type, len);
+
+        err = cbor_value_enter_container(it, &recursed);
+        while (!err && !cbor_value_at_end(&recursed))
+            err = write_item(compactor, slot, &recursed, out);
+        if (!err)
+            err = cbor_value_leave_container(it, &recursed);
+        return err;
+    }
+
+    if ((type == CborByteStringType || type == CborTextStringType) && !cbor_value_is_length_known(it)) {
+        *out = put_header(*out, (uint8_t)type, compactor->lengths[(*slot)++]);
+        return walk_chunks(it, out, &len);
+    }
+
+    /* a tag is copied as is and followed by the item it tags */
+    err = type == CborTagType ? cbor_value_advance_fixed(it) : cbor_value_advance(it);
+    if (err)
+        return err;
+    len = (size_t)(cbor_value_get_next_byte(it) - begin);
+    memcpy(*out, begin, len);
+    *out += len;
+    return type == CborTagType ? write_item(compactor, slot, it, out) : CborNoError;
+}
+
+/**
+ * Initializes \a compactor to record the lengths of up to \a capacity
+ * indefinite-length items in \a lengths. Every such item takes at least two
+ * bytes, so half the size of the encoded data is always enough.
+ */
+void cbor_compactor_init(CborCompactor *compactor, size_t *lengths, size_t capacity)
+{
+    compactor->lengths = lengths;
+    compactor->capacity = capacity;
+    compactor->count = 0;
+    compactor->size = 0;
+}
+
+/**
+ * Scans the item \a it points to, which must come from a parser over a
+ * buffer, and advances \a it past the item. Afterwards, compactor->size is
+ * the size of the compacted item and compactor->count the number of
+ * indefinite-length items found in it. Nothing needs to be rewritten if the
+ * latter is zero and the former is the size of the item.
+ *
+ * Returns CborErrorOutOfMemory if the item holds more indefinite-length items
+ * than the capacity given to cbor_compactor_init(). The scan still runs to the
+ * end of the item in that case, so compactor->count is the capacity needed
+ * for a second and final scan.
+ */
+CborError cbor_compactor_scan(CborCompactor *compactor, CborValue *it)
+{
+    CborError err;
+    if (is_external_source(it->parser))
+        return CborErrorUnsupportedType;
+
+    compactor->count = 0;
+    err = scan_item(compactor, it, CBOR_PARSER_MAX_RECURSIONS, &compactor->size);
+    if (!err && compactor->count > compactor->capacity)
+        err = CborErrorOutOfMemory;
+    return err;
+}
+
+/**
+ * Writes the compacted form of the item \a it points to into \a out, which
+ * must hold compactor->size bytes and must not overlap the source buffer, and
+ * advances \a it past the item. \a it must point to the item that was given
+ * to a successful cbor_compactor_scan() call.
+ */
+CborError cbor_compactor_write(const CborCompactor *compactor, CborValue *it, uint8_t *out)
+{
+    size_t slot = 0;
+    return write_item(compactor, &slot, it, &out);
+}
+
+/** @} */
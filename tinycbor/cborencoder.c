@@ -220,10 +220,73 @@ void cbor_encoder_init_writer(CborEncoder *encoder, CborEncoderWriteFunction wri
     encoder->flags = CborIteratorFlag_WriterFunction;
 }
 
+/**
+ * Initializes a CborEncoder structure \a encoder to write through \a writer,
+ * like cbor_encoder_init_writer(), but gathering writes in \a buffer of size
+ * \a size first. \a writer is then called with \a token once the buffer is
+ * full, instead of once for every header and value, which makes streaming to
+ * a file, socket or hash nearly as cheap as encoding to memory. A string too
+ * long for the buffer is passed to \a writer directly, without being copied,
+ * after the bytes gathered before it.
+ *
+ * \a stage holds the state of the buffer, and must outlive \a encoder and the
+ * encoders of any container created from it. Call cbor_encoder_flush() with
+ * \a encoder when done to write the bytes still gathered. Blocks of gathered
+ * bytes are written as CborEncoderAppendCborData, even though they may
+ * contain short strings.
+ */
+void cbor_encoder_init_staged_writer(CborEncoder *encoder, CborEncoderStage *stage,
+                                     CborEncoderWriteFunction writer, void *token,
+                                     uint8_t *buffer, size_t size)
+{
+    stage->writer = writer;
+    stage->token = token;
+    stage->buffer = buffer;
+    stage->size = size;
+    stage->used = 0;
+    cbor_encoder_init_writer(encoder, writer, stage);
+    encoder->flags |= CborIteratorFlag_StagedWriter;
+}
+
+static CborError flush_stage(CborEncoderStage *stage)
+{
+    CborError err;
+    if (!stage->used)
+        return CborNoError;
+    err = stage->writer(stage->token, stage->buffer, stage->used, CborEncoderAppendCborData);
+    if (!err)
+        stage->used = 0;
+    return err;
+}
+
+/**
+ * Writes the bytes gathered by an encoder initialized with
+ * cbor_encoder_init_staged_writer(). Does nothing for other encoders.
+ */
+CborError cbor_encoder_flush(CborEncoder *encoder)
+{
+    if (!(encoder->flags & CborIteratorFlag_StagedWriter))
+        return CborNoError;
+    return flush_stage((CborEncoderStage *)encoder->end);
+}
+
+/* the slow path of append_to_buffer() for data that doesn't fit in the stage */
+static CborError append_to_stage(CborEncoderStage *stage, const void *data, size_t len,
+                                 CborEncoderAppendType appendType)
+{
+    CborError err = flush_stage(stage);
+    if (err)
+        return err;
+    if (len >= stage->size)
+        return stage->writer(stage->token, data, len, appendType);
+    memcpy(stage->buffer, data, len);
+    stage->used = len;
+    return CborNoError;
+}
+
 static inline void put16(void *where, uint16_t v)
 {
-    uint16_t v_be = cbor_htons(v);
-    memcpy(where, &v_be, sizeof(v_be));
+    cbor_store_be16(where, v);
 }
 
 /* Note: Since this is currently only used in situations where OOM is the only
@@ -243,14 +306,12 @@ static inline bool isOomError(CborError err)
 
 static inline void put32(void *where, uint32_t v)
 {
-    uint32_t v_be = cbor_htonl(v);
-    memcpy(where, &v_be, sizeof(v_be));
+    cbor_store_be32(where, v);
 }
 
 static inline void put64(void *where, uint64_t v)
 {
-    uint64_t v_be = cbor_htonll(v);
-    memcpy(where, &v_be, sizeof(v_be));
+    cbor_store_be64(where, v);
 }
 
 static inline bool would_overflow(CborEncoder *encoder, size_t len)
@@ -274,6 +335,14 @@ static inline CborError append_to_buffer(CborEncoder *encoder, const void *data,
 {
     if (CBOR_ENCODER_WRITER_CONTROL >= 0) {
         if (encoder->flags & CborIteratorFlag_WriterFunction || CBOR_ENCODER_WRITER_CONTROL != 0) {
+            if (encoder->flags & CborIteratorFlag_StagedWriter) {
+                CborEncoderStage *stage = (CborEncoderStage *)encoder->end;
+                if (len > stage->size - stage->used)
+                    return append_to_stage(stage, data, len, appendType);
+                memcpy(stage->buffer + stage->used, data, len);
+                stage->used += len;
+                return CborNoError;
+            }
 #  ifdef CBOR_ENCODER_WRITE_FUNCTION
             return CBOR_ENCODER_WRITE_FUNCTION(encoder->end, data, len, appendType);
 #  else
@@ -305,33 +374,53 @@ static inline CborError append_byte_to_buffer(CborEncoder *encoder, uint8_t byte
     return append_to_buffer(encoder, &byte, 1, CborEncoderAppendCborData);
 }
 
+/* stores the header of \a ui at \a where, which has room for 9 bytes, and
+ * returns its size */
+static inline size_t store_number(uint8_t *where, uint64_t ui, uint8_t shiftedMajorType)
+{
+    unsigned more;
+    if (ui < Value8Bit) {
+        *where = shiftedMajorType + (uint8_t)ui;
+        return 1;
+    }
+
+    more = cbor_width_log2(ui);
+    *where++ = shiftedMajorType + Value8Bit + more;
+    if (more == 0)
+        *where = (uint8_t)ui;
+    else if (more == 1)
+        cbor_store_be16(where, (uint16_t)ui);
+    else if (more == 2)
+        cbor_store_be32(where, (uint32_t)ui);
+    else
+        cbor_store_be64(where, ui);
+    return 1 + ((size_t)1 << more);
+}
+
 static inline CborError encode_number_no_update(CborEncoder *encoder, uint64_t ui, uint8_t shiftedMajorType)
 {
-    /* Little-endian would have been so much more convenient here:
-     * We could just write at the beginning of buf but append_to_buffer
-     * only the necessary bytes.
-     * Since it has to be big endian, do it the other way around:
-     * write from the end. */
-    uint64_t buf[2];
-    uint8_t *const bufend = (uint8_t *)buf + sizeof(buf);
-    uint8_t *bufstart = bufend - 1;
-    put64(buf + 1, ui);     /* we probably have a bunch of zeros in the beginning */
+    /* the value goes straight into the output when there is room for the
+     * longest form, as a single store where the target allows unaligned ones */
+    uint8_t buf[9];
+    if (CBOR_ENCODER_WRITER_CONTROL >= 0) {
+        if (encoder->flags & CborIteratorFlag_StagedWriter) {
+            CborEncoderStage *stage = (CborEncoderStage *)encoder->end;
+            if (stage->size - stage->used >= sizeof(buf)) {
+                stage->used += store_number(stage->buffer + stage->used, ui, shiftedMajorType);
+                return CborNoError;
+            }
+        }
+    }
 
-    if (ui < Value8Bit) {
-        *bufstart += shiftedMajorType;
-    } else {
-        uint8_t more = 0;
-        if (ui > 0xffU)
-            ++more;
-        if (ui > 0xffffU)
-            ++more;
-        if (ui > 0xffffffffU)
-            ++more;
-        bufstart -= (size_t)1 << more;
-        *bufstart = shiftedMajorType + Value8Bit + more;
+#if CBOR_ENCODER_WRITER_CONTROL <= 0
+    if (!(encoder->flags & CborIteratorFlag_WriterFunction) && encoder->end &&
+            encoder->end - encoder->data.ptr >= (ptrdiff_t)sizeof(buf)) {
+        encoder->data.ptr += store_number(encoder->data.ptr, ui, shiftedMajorType);
+        return CborNoError;
     }
+#endif
 
-    return append_to_buffer(encoder, bufstart, bufend - bufstart, CborEncoderAppendCborData);
+    return append_to_buffer(encoder, buf, store_number(buf, ui, shiftedMajorType), CborEncoderAppendCborData);
 }
 
 static inline void saturated_decrement(CborEncoder *encoder)
@@ -500,7 +589,7 @@ static CborError create_container(CborEncoder *encoder, CborEncoder *container,
     cbor_static_assert(((ArrayType << MajorTypeShift) & CborIteratorFlag_ContainerIsMap) == 0);
     container->flags = shiftedMajorType & CborIteratorFlag_ContainerIsMap;
     if (CBOR_ENCODER_WRITER_CONTROL == 0)
-        container->flags |= encoder->flags & CborIteratorFlag_WriterFunction;
+        container->flags |= encoder->flags & (CborIteratorFlag_WriterFunction | CborIteratorFlag_StagedWriter);
 
     if (length == CborIndefiniteLength) {
         container->flags |= CborIteratorFlag_UnknownLength;
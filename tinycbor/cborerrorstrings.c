@@ -68,6 +68,7 @@
  * \omitvalue CborErrorUnsupportedType
  * \value CborErrorJsonObjectKeyIsAggregate Conversion to JSON failed because the key in a map is a CBOR map or array
  * \value CborErrorJsonObjectKeyNotString Conversion to JSON failed because the key in a map is not a text string
+ * \value CborErrorJsonSyntax           Conversion from JSON failed because the text is not valid JSON
  * \value CborErrorOutOfMemory          During CBOR encoding, the buffer provided is insufficient for encoding the data item;
  *                                      in other situations, TinyCBOR failed to allocate memory
  * \value CborErrorInternalError        An internal error occurred in TinyCBOR
@@ -144,6 +145,8 @@ const char *cbor_error_string(CborError error)
         return _("conversion to JSON failed: key in object is an array or map");
     } else if ( error == CborErrorJsonNotImplemented) {
         return _("conversion to JSON failed: open_memstream unavailable");
+    } else if ( error == CborErrorJsonSyntax) {
+        return _("conversion from JSON failed: syntax error");
     } else if ( error == CborErrorInternalError) {
         return _("internal error");
     } else {
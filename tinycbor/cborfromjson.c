@@ -0,0 +1,540 @@
+/****************************************************************************
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+**
+****************************************************************************/
+
+#ifndef _BSD_SOURCE
+#define _BSD_SOURCE 1
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+#ifndef __STDC_LIMIT_MACROS
+#  define __STDC_LIMIT_MACROS 1
+#endif
+
+#include "cbor.h"
+#include "cborjson.h"
+#include "cborinternal_p.h"
+#include "compilersupport_p.h"
+#include "utf8_p.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \defgroup CborFromJson Converting JSON to CBOR
+ * \brief Group of functions used to convert JSON text to CBOR.
+ *
+ * cbor_encode_json() tokenizes JSON text and feeds each value straight to a
+ * CborEncoder, so no tree of the document is built. It takes one pass and
+ * needs no more memory than the nesting of the document, plus a copy of any
+ * string that contains escape sequences.
+ *
+ * The text maps to CBOR as follows:
+ * \li Objects and arrays become maps and arrays of indefinite length, as
+ *     their sizes are only known at their end. cbor_compactor_scan() and
+ *     cbor_compactor_write() can rewrite the result with definite lengths.
+ * \li Strings become text strings. They must be valid UTF-8, and escaped
+ *     surrogates must come in pairs.
+ * \li Numbers without a fraction or exponent become integers if they fit in
+ *     the CBOR integer range of -2<sup>64</sup> to 2<sup>64</sup>-1. Other
+ *     numbers become floats if single precision holds them exactly, or doubles
+ *     otherwise.
+ * \li \c true, \c false and \c null become the simple values of the same name.
+ *
+ * Decimal numbers are converted with Clinger's fast path when that is exact:
+ * at most 19 significant digits, a significand below 2<sup>53</sup> and a
+ * power of ten up to 10<sup>22</sup>. Other numbers are passed to a
+ * CborJsonNumberFunction, which can be strtod() or any correctly rounding
+ * parser.
+ */
+
+/**
+ * \addtogroup CborFromJson
+ * @{
+ */
+
+typedef struct JsonReader {
+    const uint8_t *ptr;
+    const uint8_t *end;
+    CborJsonNumberFunction parseNumber;
+    bool allocFailed;           /* a string copy could not be allocated */
+} JsonReader;
+
+static CborError json_value(JsonReader *reader, CborEncoder *encoder, int recursionLeft);
+
+static inline bool json_is_space(uint8_t c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool json_is_digit(uint8_t c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static void skip_whitespace(JsonReader *reader)
+{
+    while (reader->ptr < reader->end && json_is_space(*reader->ptr))
+        ++reader->ptr;
+}
+
+/* keeps going after the encoder runs out of buffer, so that it can count the
+ * size the output needs, but not after an allocation of our own failed */
+static inline bool is_fatal(const JsonReader *reader, CborError err)
+{
+    return err != CborNoError && (err != CborErrorOutOfMemory || reader->allocFailed);
+}
+
+static int hex_digit(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* reads the 4 hex digits after "\u" at \a ptr */
+static CborError read_hex4(const uint8_t *ptr, const uint8_t *end, uint32_t *value)
+{
+    int i;
+    if (end - ptr < 4)
+        return CborErrorJsonSyntax;
+    *value = 0;
+    for (i = 0; i < 4; ++i) {
+        int digit = hex_digit(ptr[i]);
+        if (digit < 0)
+            return CborErrorJsonSyntax;
+        *value = (*value << 4) | (uint32_t)digit;
+    }
+    return CborNoError;
+}
+
+/* Reads the escape sequence after the backslash at *ptr, storing the code
+ * point and advancing *ptr past it. */
+static CborError read_escape(const uint8_t **ptr, const uint8_t *end, uint32_t *uc)
+{
+    const uint8_t *p = *ptr + 1;
+    uint8_t c;
+    CborError err;
+
+    if (p == end)
+        return CborErrorJsonSyntax;
+    c = *p++;
+    if (c == '"' || c == '\\' || c == '/')
+        *uc = c;
+    else if (c == 'b')
+        *uc = '\b';
+    else if (c == 'f')
+        *uc = '\f';
+    else if (c == 'n')
+        *uc = '\n';
+    else if (c == 'r')
+        *uc = '\r';
+    else if (c == 't')
+        *uc = '\t';
+    else if (c != 'u')
+        return CborErrorJsonSyntax;
+    else {
+        err = read_hex4(p, end, uc);
+        if (err)
+            return err;
+        p += 4;
+        if (*uc >= 0xdc00 && *uc <= 0xdfff)
+            return CborErrorInvalidUtf8TextString;      /* lone low surrogate */
+        if (*uc >= 0xd800 && *uc <= 0xdbff) {
+            uint32_t low;
+            if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || read_hex4(p + 2, end, &low) ||
+                    low < 0xdc00 || low > 0xdfff)
+                return CborErrorInvalidUtf8TextString;  /* high surrogate without its pair */
+            *uc = 0x10000 + ((*uc - 0xd800) << 10) + (low - 0xdc00);
+            p += 6;
+        }
+    }
+    *ptr = p;
+    return CborNoError;
+}
+
+static size_t utf8_length(uint32_t uc)
+{
+    return uc < 0x80 ? 1 : uc < 0x800 ? 2 : uc < 0x10000 ? 3 : 4;
+}
+
+static uint8_t *put_utf8(uint8_t *out, uint32_t uc)
+{
+    size_t len = utf8_length(uc);
+    static const uint8_t lead[] = { 0, 0, 0xc0, 0xe0, 0xf0 };
+    size_t i;
+    for (i = len - 1; i > 0; --i) {
+        out[i] = 0x80 | (uc & 0x3f);
+        uc >>= 6;
+    }
+    out[0] = (uint8_t)(lead[len] | uc);
+    return out + len;
+}
+
+/* Scans the string after the opening quote at reader->ptr, checking it and
+ * computing the length of its UTF-8 form. Leaves reader->ptr on the closing
+ * quote. */
+static CborError scan_string(JsonReader *reader, size_t *len, bool *escaped)
+{
+    const uint8_t *ptr = reader->ptr + 1;
+    const uint8_t *end = reader->end;
+
+    *len = 0;
+    *escaped = false;
+    while (ptr < end && *ptr != '"') {
+        uint8_t c = *ptr;
+        if (c == '\\') {
+            uint32_t uc;
+            CborError err = read_escape(&ptr, end, &uc);
+            if (err)
+                return err;
+            *len += utf8_length(uc);
+            *escaped = true;
+        } else if (c < 0x20) {
+            return CborErrorJsonSyntax;                 /* control characters must be escaped */
+        } else if (c < 0x80) {
+            ++ptr;
+            ++*len;
+        } else {
+            const uint8_t *start = ptr;
+            if (get_utf8(&ptr, end) == ~0U)
+                return CborErrorInvalidUtf8TextString;
+            *len += (size_t)(ptr - start);
+        }
+    }
+    if (ptr == end)
+        return CborErrorJsonSyntax;
+    reader->ptr = ptr;
+    return CborNoError;
+}
+
+/* copies the checked string from \a ptr to the closing quote into \a out,
+ * replacing its escape sequences */
+static void unescape_string(const uint8_t *ptr, const uint8_t *end, uint8_t *out)
+{
+    while (*ptr != '"') {
+        if (*ptr == '\\') {
+            uint32_t uc;
+            read_escape(&ptr, end, &uc);    /* can't fail, the string was scanned */
+            out = put_utf8(out, uc);
+        } else {
+            *out++ = *ptr++;
+        }
+    }
+}
+
+static CborError json_string(JsonReader *reader, CborEncoder *encoder)
+{
+    const uint8_t *begin = reader->ptr + 1;
+    uint8_t *copy;
+    size_t len;
+    bool escaped;
+    CborError err = scan_string(reader, &len, &escaped);
+    if (err)
+        return err;
+    ++reader->ptr;          /* past the closing quote */
+
+    if (!escaped)
+        return cbor_encode_text_string(encoder, (const char *)begin, len);
+
+    /* escape sequences are longer than the characters they stand for, so the
+     * string is unescaped into a copy; short ones fit on the stack */
+    if (len <= 64) {
+        uint8_t local[64];
+        unescape_string(begin, reader->end, local);
+        return cbor_encode_text_string(encoder, (const char *)local, len);
+    }
+    copy = (uint8_t *)malloc(len);
+    if (!copy) {
+        reader->allocFailed = true;
+        return CborErrorOutOfMemory;
+    }
+    unescape_string(begin, reader->end, copy);
+    err = cbor_encode_text_string(encoder, (const char *)copy, len);
+    free(copy);
+    return err;
+}
+
+#ifndef CBOR_NO_FLOATING_POINT
+static CborError encode_shortest_float(CborEncoder *encoder, double value)
+{
+    float f = (float)value;
+    if ((double)f == value)
+        return cbor_encode_float(encoder, f);
+    return cbor_encode_double(encoder, value);
+}
+#endif
+
+static CborError json_number(JsonReader *reader, CborEncoder *encoder)
+{
+    const uint8_t *begin = reader->ptr;
+    const uint8_t *ptr = begin;
+    const uint8_t *end = reader->end;
+    uint64_t significand = 0;
+    int digits = 0;             /* significant digits in significand */
+    int exponent = 0;           /* power of ten to scale significand by */
+    bool negative = false;
+    bool truncated = false;     /* more than 19 significant digits */
+    bool integral = true;
+
+    if (*ptr == '-') {
+        negative = true;
+        ++ptr;
+    }
+
+    /* integer part: 0 or digits not starting with 0 */
+    if (ptr == end || !json_is_digit(*ptr))
+        return CborErrorJsonSyntax;
+    if (*ptr == '0') {
+        ++ptr;
+    } else {
+        for ( ; ptr < end && json_is_digit(*ptr); ++ptr) {
+            if (digits < 19) {
+                significand = significand * 10 + (*ptr - '0');
+                ++digits;
+            } else {
+                ++exponent;
+                truncated = true;
+            }
+        }
+    }
+
+    if (ptr < end && *ptr == '.') {
+        integral = false;
+        if (++ptr == end || !json_is_digit(*ptr))
+            return CborErrorJsonSyntax;
+        for ( ; ptr < end && json_is_digit(*ptr); ++ptr) {
+            if (significand == 0 && *ptr == '0') {
+                --exponent;     /* leading zeros aren't significant */
+            } else if (digits < 19) {
+                significand = significand * 10 + (*ptr - '0');
+                ++digits;
+                --exponent;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+
+    if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+        bool negativeExponent = false;
+        int explicitExponent = 0;
+        integral = false;
+        if (++ptr < end && (*ptr == '+' || *ptr == '-'))
+            negativeExponent = *ptr++ == '-';
+        if (ptr == end || !json_is_digit(*ptr))
+            return CborErrorJsonSyntax;
+        for ( ; ptr < end && json_is_digit(*ptr); ++ptr) {
+            if (explicitExponent < 100000)
+                explicitExponent = explicitExponent * 10 + (*ptr - '0');
+        }
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+    }
+    reader->ptr = ptr;
+
+    if (integral) {
+        /* read the digits again, exactly: 2^64 - 1 has 20 of them */
+        const uint8_t *digit = begin + negative;
+        uint64_t value = 0;
+        for ( ; digit < ptr; ++digit) {
+            unsigned d = *digit - '0';
+            if (value > (UINT64_MAX - d) / 10)
+                break;
+            value = value * 10 + d;
+        }
+        if (digit == ptr) {
+            if (!negative || value == 0)
+                return cbor_encode_uint(encoder, value);
+            return cbor_encode_negative_int(encoder, value);
+        }
+        if (negative && ptr - digit == 1 && value == UINT64_MAX / 10 && *digit == '6')
+            return cbor_encode_negative_int(encoder, 0);    /* -2^64 */
+    }
+
+#ifndef CBOR_NO_FLOATING_POINT
+    {
+        static const double powersOf10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        double value;
+
+        if (significand == 0) {
+            value = 0;
+        } else if (!truncated && significand <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+            /* both the significand and the power of ten are exact doubles, so
+             * the one rounding of the product or quotient is correct */
+            value = (double)significand;
+            value = exponent < 0 ? value / powersOf10[-exponent] : value * powersOf10[exponent];
+        } else {
+            CborError err;
+            if (!reader->parseNumber)
+                return CborErrorUnsupportedType;
+            err = reader->parseNumber((const char *)begin, (size_t)(ptr - begin), &value);
+            if (err)
+                return err;
+            return encode_shortest_float(encoder, value);
+        }
+        return encode_shortest_float(encoder, negative ? -value : value);
+    }
+#else
+    return CborErrorUnsupportedType;
+#endif
+}
+
+static CborError json_literal(JsonReader *reader, const char *literal, size_t len)
+{
+    if ((size_t)(reader->end - reader->ptr) < len || memcmp(reader->ptr, literal, len) != 0)
+        return CborErrorJsonSyntax;
+    reader->ptr += len;
+    return CborNoError;
+}
+
+static CborError json_container(JsonReader *reader, CborEncoder *encoder, bool isObject, int recursionLeft)
+{
+    CborEncoder container;
+    CborError err;
+    uint8_t close = isObject ? '}' : ']';
+
+    err = isObject ? cbor_encoder_create_map(encoder, &container, CborIndefiniteLength) :
+                     cbor_encoder_create_array(encoder, &container, CborIndefiniteLength);
+    if (is_fatal(reader, err))
+        return err;
+
+    ++reader->ptr;
+    skip_whitespace(reader);
+    if (reader->ptr < reader->end && *reader->ptr == close) {
+        ++reader->ptr;
+        return cbor_encoder_close_container(encoder, &container);
+    }
+
+    while (1) {
+        if (isObject) {
+            if (reader->ptr == reader->end || *reader->ptr != '"')
+                return CborErrorJsonSyntax;             /* keys must be strings */
+            err = json_string(reader, &container);
+            if (is_fatal(reader, err))
+                return err;
+            skip_whitespace(reader);
+            if (reader->ptr == reader->end || *reader->ptr++ != ':')
+                return CborErrorJsonSyntax;
+            skip_whitespace(reader);
+        }
+
+        err = json_value(reader, &container, recursionLeft - 1);
+        if (is_fatal(reader, err))
+            return err;
+
+        skip_whitespace(reader);
+        if (reader->ptr == reader->end)
+            return CborErrorJsonSyntax;
+        if (*reader->ptr == close)
+            break;
+        if (*reader->ptr++ != ',')
+            return CborErrorJsonSyntax;
+        skip_whitespace(reader);
+    }
+
+    ++reader->ptr;
+    return cbor_encoder_close_container(encoder, &container);
+}
+
+/* converts the value at reader->ptr, which is past any whitespace */
+static CborError json_value(JsonReader *reader, CborEncoder *encoder, int recursionLeft)
+{
+    CborError err;
+    uint8_t c;
+
+    if (!recursionLeft)
+        return CborErrorNestingTooDeep;
+    if (reader->ptr == reader->end)
+        return CborErrorJsonSyntax;
+
+    c = *reader->ptr;
+    if (c == '{' || c == '[')
+        return json_container(reader, encoder, c == '{', recursionLeft);
+    if (c == '"')
+        return json_string(reader, encoder);
+    if (c == '-' || json_is_digit(c))
+        return json_number(reader, encoder);
+    if (c == 't') {
+        err = json_literal(reader, "true", 4);
+        return err ? err : cbor_encode_boolean(encoder, true);
+    }
+    if (c == 'f') {
+        err = json_literal(reader, "false", 5);
+        return err ? err : cbor_encode_boolean(encoder, false);
+    }
+    if (c == 'n') {
+        err = json_literal(reader, "null", 4);
+        return err ? err : cbor_encode_null(encoder);
+    }
+    return CborErrorJsonSyntax;
+}
+
+/**
+ * \typedef CborJsonNumberFunction
+ * Converts the JSON number of \a len characters at \a text, which is not
+ * NUL-terminated, to the nearest double and stores it in \a value. It is only
+ * called for numbers that the fast path can't convert exactly.
+ */
+
+/**
+ * Converts the JSON text of \a len bytes at \a json, which must hold exactly
+ * one value with optional whitespace around it, to CBOR and appends it to \a
+ * encoder. \a parseNumber converts the numbers that need more than the fast
+ * path; if it is null, those fail with CborErrorUnsupportedType.
+ *
+ * Returns CborErrorJsonSyntax if the text is not valid JSON,
+ * CborErrorInvalidUtf8TextString if a string is not valid UTF-8 or has an
+ * unpaired surrogate escape, and CborErrorNestingTooDeep if arrays and objects
+ * are nested more than CBOR_PARSER_MAX_RECURSIONS deep. Like the other
+ * encoding functions, it returns CborErrorOutOfMemory if \a encoder ran out of
+ * buffer, after which cbor_encoder_get_extra_bytes_needed() tells how much
+ * more it needs. It also returns CborErrorOutOfMemory, at once and with the
+ * output incomplete, if it cannot allocate the copy of a long string with
+ * escape sequences.
+ */
+CborError cbor_encode_json(CborEncoder *encoder, const char *json, size_t len, CborJsonNumberFunction parseNumber)
+{
+    JsonReader reader;
+    CborError err;
+
+    reader.ptr = (const uint8_t *)json;
+    reader.end = reader.ptr + len;
+    reader.parseNumber = parseNumber;
+    reader.allocFailed = false;
+
+    skip_whitespace(&reader);
+    err = json_value(&reader, encoder, CBOR_PARSER_MAX_RECURSIONS);
+    if (is_fatal(&reader, err))
+        return err;
+    skip_whitespace(&reader);
+    if (reader.ptr != reader.end)
+        return CborErrorJsonSyntax;
+    return err;
+}
+
+/** @} */
@@ -37,7 +37,7 @@
 #endif
 
 #ifndef CBOR_NO_HALF_FLOAT_TYPE
-#  if defined(__F16C__) || defined(__AVX2__)
+#  if defined(__F16C__)
 #    include <immintrin.h>
 static inline unsigned short encode_half(float val)
 {
@@ -84,16 +84,39 @@ static inline unsigned short encode_half(double val)
     return (unsigned short)(sign | ((exp + 15) << 10) | mant);
 }
 
-/* this function was copied & adapted from RFC 7049 Appendix D */
-static inline double decode_half(unsigned short half)
+/* Converts by rearranging the bit fields instead of going through ldexp() as
+ * RFC 7049 Appendix D does, so it needs neither libm nor an FPU (soft-float
+ * targets like armv6m only pay for integer operations). Every half-precision
+ * value is exactly representable as a float. */
+static inline float decode_half(unsigned short half)
 {
-    int exp = (half >> 10) & 0x1f;
-    int mant = half & 0x3ff;
-    double val;
-    if (exp == 0) val = ldexp(mant, -24);
-    else if (exp != 31) val = ldexp(mant + 1024, exp - 25);
-    else val = mant == 0 ? INFINITY : NAN;
-    return half & 0x8000 ? -val : val;
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exp = (half >> 10) & 0x1f;
+    uint32_t mant = half & 0x3ff;
+    uint32_t bits;
+    float val;
+
+    if (likely(exp != 0 && exp != 31)) {
+        /* normal: rebias the exponent from 15 to 127 */
+        bits = sign | ((exp + (127 - 15)) << 23) | (mant << 13);
+    } else if (exp == 31) {
+        /* infinity or NaN, keeping the NaN payload */
+        bits = sign | 0x7f800000U | (mant << 13);
+    } else if (mant == 0) {
+        /* signed zero */
+        bits = sign;
+    } else {
+        /* subnormal: normalize it, as it is a normal number in float */
+        exp = 127 - 15 + 1;
+        do {
+            mant <<= 1;
+            --exp;
+        } while ((mant & 0x400) == 0);
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+
+    memcpy(&val, &bits, sizeof(val));
+    return val;
 }
 #  endif
 #endif /* CBOR_NO_HALF_FLOAT_TYPE */
@@ -161,11 +184,21 @@ enum {
     BreakByte               = (unsigned)Break | (SimpleTypesType << MajorTypeShift)
 };
 
+/* A negative CBOR_PARSER_READER_CONTROL builds a parser for in-memory
+ * buffers only, where this is constant false and the reader paths below are
+ * compiled out. */
+static inline bool is_external_source(const CborParser *parser)
+{
+    if (CBOR_PARSER_READER_CONTROL < 0)
+        return false;
+    return CBOR_PARSER_READER_CONTROL != 0 || (parser->flags & CborParserFlag_ExternalSource);
+}
+
 static inline void copy_current_position(CborValue *dst, const CborValue *src)
 {
     /* This "if" is here for pedantry only: the two branches should perform
      * the same memory operation. */
-    if (src->parser->flags & CborParserFlag_ExternalSource)
+    if (is_external_source(src->parser))
         dst->source.token = src->source.token;
     else
         dst->source.ptr = src->source.ptr;
@@ -173,14 +206,12 @@ static inline void copy_current_position(CborValue *dst, const CborValue *src)
 
 static inline bool can_read_bytes(const CborValue *it, size_t n)
 {
-    if (CBOR_PARSER_READER_CONTROL >= 0) {
-        if (it->parser->flags & CborParserFlag_ExternalSource || CBOR_PARSER_READER_CONTROL != 0) {
+    if (is_external_source(it->parser)) {
 #ifdef CBOR_PARSER_CAN_READ_BYTES_FUNCTION
-            return CBOR_PARSER_CAN_READ_BYTES_FUNCTION(it->source.token, n);
+        return CBOR_PARSER_CAN_READ_BYTES_FUNCTION(it->source.token, n);
 #else
-            return it->parser->source.ops->can_read_bytes(it->source.token, n);
+        return it->parser->source.ops->can_read_bytes(it->source.token, n);
 #endif
-        }
     }
 
     /* Convert the pointer subtraction to size_t since end >= ptr
@@ -191,15 +222,13 @@ static inline bool can_read_bytes(const CborValue *it, size_t n)
 
 static inline void advance_bytes(CborValue *it, size_t n)
 {
-    if (CBOR_PARSER_READER_CONTROL >= 0) {
-        if (it->parser->flags & CborParserFlag_ExternalSource || CBOR_PARSER_READER_CONTROL != 0) {
+    if (is_external_source(it->parser)) {
 #ifdef CBOR_PARSER_ADVANCE_BYTES_FUNCTION
-            CBOR_PARSER_ADVANCE_BYTES_FUNCTION(it->source.token, n);
+        CBOR_PARSER_ADVANCE_BYTES_FUNCTION(it->source.token, n);
 #else
-            it->parser->source.ops->advance_bytes(it->source.token, n);
+        it->parser->source.ops->advance_bytes(it->source.token, n);
 #endif
-            return;
-        }
+        return;
     }
 
     it->source.ptr += n;
@@ -207,14 +236,12 @@ static inline void advance_bytes(CborValue *it, size_t n)
 
 static inline CborError transfer_string(CborValue *it, const void **ptr, size_t offset, size_t len)
 {
-    if (CBOR_PARSER_READER_CONTROL >= 0) {
-        if (it->parser->flags & CborParserFlag_ExternalSource || CBOR_PARSER_READER_CONTROL != 0) {
+    if (is_external_source(it->parser)) {
 #ifdef CBOR_PARSER_TRANSFER_STRING_FUNCTION
-            return CBOR_PARSER_TRANSFER_STRING_FUNCTION(it->source.token, ptr, offset, len);
+        return CBOR_PARSER_TRANSFER_STRING_FUNCTION(it->source.token, ptr, offset, len);
 #else
-            return it->parser->source.ops->transfer_string(it->source.token, ptr, offset, len);
+        return it->parser->source.ops->transfer_string(it->source.token, ptr, offset, len);
 #endif
-        }
     }
 
     it->source.ptr += offset;
@@ -228,14 +255,12 @@ static inline CborError transfer_string(CborValue *it, const void **ptr, size_t
 
 static inline void *read_bytes_unchecked(const CborValue *it, void *dst, size_t offset, size_t n)
 {
-    if (CBOR_PARSER_READER_CONTROL >= 0) {
-        if (it->parser->flags & CborParserFlag_ExternalSource || CBOR_PARSER_READER_CONTROL != 0) {
+    if (is_external_source(it->parser)) {
 #ifdef CBOR_PARSER_READ_BYTES_FUNCTION
-            return CBOR_PARSER_READ_BYTES_FUNCTION(it->source.token, dst, offset, n);
+        return CBOR_PARSER_READ_BYTES_FUNCTION(it->source.token, dst, offset, n);
 #else
-            return it->parser->source.ops->read_bytes(it->source.token, dst, offset, n);
+        return it->parser->source.ops->read_bytes(it->source.token, dst, offset, n);
 #endif
-        }
     }
 
     return memcpy(dst, it->source.ptr + offset, n);
@@ -251,32 +276,37 @@ static inline void *read_bytes(const CborValue *it, void *dst, size_t offset, si
     return NULL;
 }
 
+/* Returns n bytes at offset: in place when parsing a buffer, or copied into
+ * dst by the reader. */
+static inline const uint8_t *peek_bytes_unchecked(const CborValue *it, void *dst, size_t offset, size_t n)
+{
+    if (is_external_source(it->parser))
+        return (const uint8_t *)read_bytes_unchecked(it, dst, offset, n);
+    return it->source.ptr + offset;
+}
+
 static inline uint16_t read_uint8(const CborValue *it, size_t offset)
 {
     uint8_t result;
-    read_bytes_unchecked(it, &result, offset, sizeof(result));
-    return result;
+    return *peek_bytes_unchecked(it, &result, offset, sizeof(result));
 }
 
 static inline uint16_t read_uint16(const CborValue *it, size_t offset)
 {
     uint16_t result;
-    read_bytes_unchecked(it, &result, offset, sizeof(result));
-    return cbor_ntohs(result);
+    return cbor_load_be16(peek_bytes_unchecked(it, &result, offset, sizeof(result)));
 }
 
 static inline uint32_t read_uint32(const CborValue *it, size_t offset)
 {
     uint32_t result;
-    read_bytes_unchecked(it, &result, offset, sizeof(result));
-    return cbor_ntohl(result);
+    return cbor_load_be32(peek_bytes_unchecked(it, &result, offset, sizeof(result)));
 }
 
 static inline uint64_t read_uint64(const CborValue *it, size_t offset)
 {
     uint64_t result;
-    read_bytes_unchecked(it, &result, offset, sizeof(result));
-    return cbor_ntohll(result);
+    return cbor_load_be64(peek_bytes_unchecked(it, &result, offset, sizeof(result)));
 }
 
 static inline CborError extract_number_checked(const CborValue *it, uint64_t *value, size_t *bytesUsed)
@@ -313,4 +343,13 @@ static inline CborError extract_number_checked(const CborValue *it, uint64_t *va
     return CborNoError;
 }
 
+/* FNV-1a, used to hash encoded map keys */
+static inline uint32_t cbor_hash_bytes(const uint8_t *ptr, size_t len)
+{
+    uint32_t h = 2166136261U;
+    while (len--)
+        h = (h ^ *ptr++) * 16777619U;
+    return h;
+}
+
 #endif /* CBORINTERNAL_P_H */
@@ -47,6 +47,24 @@ enum CborToJsonFlags
     CborConvertDefaultFlags = 0
 };
 
+typedef CborError (*CborJsonWriteFunction)(void *token, const char *data, size_t len);
+typedef size_t (*CborJsonDoubleFunction)(char *buffer, size_t size, double value);
+
+typedef struct CborJsonStream
+{
+    CborJsonWriteFunction write;
+    CborJsonDoubleFunction formatDouble;
+    void *token;
+} CborJsonStream;
+
+CBOR_API CborError cbor_value_to_json_stream(const CborJsonStream *stream, CborValue *value, int flags);
+
+/* Conversion from JSON */
+typedef CborError (*CborJsonNumberFunction)(const char *text, size_t len, double *value);
+
+CBOR_API CborError cbor_encode_json(CborEncoder *encoder, const char *json, size_t len, CborJsonNumberFunction parseNumber);
+
+/* The following API requires a hosted C implementation (uses FILE*) */
 CBOR_API CborError cbor_value_to_json_advance(FILE *out, CborValue *value, int flags);
 CBOR_INLINE_API CborError cbor_value_to_json(FILE *out, const CborValue *value, int flags)
 {
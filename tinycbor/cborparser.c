@@ -142,6 +142,69 @@
  * \endif
  */
 
+/*
+ * Everything preparse_value needs to know about an initial byte: the
+ * resolved CborType, the iterator flags to set, how many argument bytes
+ * follow and the preset value of it->extra. Initial bytes that can never
+ * start an item have CborInvalidType and the error (as an offset from
+ * CborErrorGarbageAtEnd) in extra.
+ */
+typedef struct InitialByte
+{
+    uint8_t type;
+    uint8_t flags;
+    uint8_t bytesNeeded;
+    uint8_t extra;
+} InitialByte;
+
+#define IB(type, flags, bytes, extra)   { (uint8_t)(type), (uint8_t)(flags), bytes, extra }
+#define IB_ERROR(err)                   IB(CborInvalidType, 0, 0, (uint8_t)((err) - CborErrorGarbageAtEnd))
+#define IB_SMALL8(type, flags, n) \
+    IB(type, flags, 0, (n)), IB(type, flags, 0, (n) + 1), IB(type, flags, 0, (n) + 2), IB(type, flags, 0, (n) + 3), \
+    IB(type, flags, 0, (n) + 4), IB(type, flags, 0, (n) + 5), IB(type, flags, 0, (n) + 6), IB(type, flags, 0, (n) + 7)
+#define IB_SMALL4(type, flags, n) \
+    IB(type, flags, 0, (n)), IB(type, flags, 0, (n) + 1), IB(type, flags, 0, (n) + 2), IB(type, flags, 0, (n) + 3)
+/* the 16-bit arguments are read into extra; the 32 and 64-bit ones are extracted later, so they get flagged */
+#define IB_ARGUMENTS(type, flags) \
+    IB(type, flags, 1, 0), IB(type, flags, 2, 0), \
+    IB(type, (flags) | CborIteratorFlag_IntegerValueTooLarge, 4, 0), \
+    IB(type, (flags) | CborIteratorFlag_IntegerValueIs64Bit | CborIteratorFlag_IntegerValueTooLarge, 8, 0)
+#define IB_MAJOR_TYPE(type, flags, indefinite) \
+    IB_SMALL8(type, flags, 0), IB_SMALL8(type, flags, 8), IB_SMALL8(type, flags, 16), \
+    IB_ARGUMENTS(type, flags), \
+    IB_ERROR(CborErrorIllegalNumber), IB_ERROR(CborErrorIllegalNumber), IB_ERROR(CborErrorIllegalNumber), \
+    indefinite
+
+static const InitialByte initial_bytes[256] = {
+    IB_MAJOR_TYPE(CborIntegerType, 0, IB_ERROR(CborErrorIllegalNumber)),
+    IB_MAJOR_TYPE(CborIntegerType, CborIteratorFlag_NegativeInteger, IB_ERROR(CborErrorIllegalNumber)),
+    IB_MAJOR_TYPE(CborByteStringType, 0, IB(CborByteStringType, CborIteratorFlag_UnknownLength, 0, IndefiniteLength)),
+    IB_MAJOR_TYPE(CborTextStringType, 0, IB(CborTextStringType, CborIteratorFlag_UnknownLength, 0, IndefiniteLength)),
+    IB_MAJOR_TYPE(CborArrayType, 0, IB(CborArrayType, CborIteratorFlag_UnknownLength, 0, IndefiniteLength)),
+    IB_MAJOR_TYPE(CborMapType, 0, IB(CborMapType, CborIteratorFlag_UnknownLength, 0, IndefiniteLength)),
+    IB_MAJOR_TYPE(CborTagType, 0, IB_ERROR(CborErrorIllegalNumber)),
+
+    /* major type 7 */
+    IB_SMALL8(CborSimpleType, 0, 0), IB_SMALL8(CborSimpleType, 0, 8), IB_SMALL4(CborSimpleType, 0, 16),
+    IB(CborBooleanType, 0, 0, 0),
+    IB(CborBooleanType, 0, 0, TrueValue),
+    IB(CborNullType, 0, 0, NullValue),
+    IB(CborUndefinedType, 0, 0, UndefinedValue),
+    IB(CborSimpleType, 0, 1, 0),
+    IB(CborHalfFloatType, 0, 2, 0),
+    IB(CborFloatType, CborIteratorFlag_IntegerValueTooLarge, 4, 0),
+    IB(CborDoubleType, CborIteratorFlag_IntegerValueIs64Bit | CborIteratorFlag_IntegerValueTooLarge, 8, 0),
+    IB_ERROR(CborErrorUnknownType), IB_ERROR(CborErrorUnknownType), IB_ERROR(CborErrorUnknownType),
+    IB_ERROR(CborErrorUnexpectedBreak)
+};
+
+#undef IB_MAJOR_TYPE
+#undef IB_ARGUMENTS
+#undef IB_SMALL4
+#undef IB_SMALL8
+#undef IB_ERROR
+#undef IB
+
 static uint64_t extract_number_and_advance(CborValue *it)
 {
     /* This function is only called after we've verified that the number
@@ -150,10 +213,7 @@ static uint64_t extract_number_and_advance(CborValue *it)
     uint64_t v = _cbor_value_extract_int64_helper(it);
 
     read_bytes_unchecked(it, &descriptor, 0, 1);
-    descriptor &= SmallValueMask;
-
-    size_t bytesNeeded = descriptor < Value8Bit ? 0 : (1 << (descriptor - Value8Bit));
-    advance_bytes(it, bytesNeeded + 1);
+    advance_bytes(it, initial_bytes[descriptor].bytesNeeded + 1U);
 
     return v;
 }
@@ -172,6 +232,7 @@ static CborError preparse_value(CborValue *it)
         FlagsToKeep = CborIteratorFlag_ContainerIsMap | CborIteratorFlag_NextIsMapKey
     };
     uint8_t descriptor;
+    const InitialByte *ib;
 
     /* are we at the end? */
     it->type = CborInvalidType;
@@ -179,94 +240,32 @@ static CborError preparse_value(CborValue *it)
     if (!read_bytes(it, &descriptor, 0, 1))
         return CborErrorUnexpectedEOF;
 
-    uint8_t type = descriptor & MajorTypeMask;
-    it->type = type;
-    it->extra = (descriptor &= SmallValueMask);
+    ib = &initial_bytes[descriptor];
+    if (unlikely(ib->type == CborInvalidType))
+        return (CborError)(CborErrorGarbageAtEnd + ib->extra);
 
-    if (descriptor > Value64Bit)
-    {
-        if (unlikely(descriptor != IndefiniteLength))
-            return type == CborSimpleType ? CborErrorUnknownType : CborErrorIllegalNumber;
-        if (likely(!is_fixed_type(type)))
-        {
-            /* special case */
-            it->flags |= CborIteratorFlag_UnknownLength;
-            it->type = type;
-            return CborNoError;
-        }
-        return type == CborSimpleType ? CborErrorUnexpectedBreak : CborErrorIllegalNumber;
-    }
+    if (ib->bytesNeeded && !can_read_bytes(it, ib->bytesNeeded + 1U))
+        return CborErrorUnexpectedEOF;
 
-    size_t bytesNeeded = descriptor < Value8Bit ? 0 : (1 << (descriptor - Value8Bit));
+    it->type = ib->type;
+    it->flags |= ib->flags;
+    it->extra = ib->extra;
 
-    if (bytesNeeded)
+    /* read up to 16 bits into it->extra */
+    if (ib->bytesNeeded == 1)
     {
-        if (!can_read_bytes(it, bytesNeeded + 1))
-            return CborErrorUnexpectedEOF;
-
-        it->extra = 0;
-
-        /* read up to 16 bits into it->extra */
-        if (bytesNeeded == 1)
-        {
-            uint8_t extra;
-            read_bytes_unchecked(it, &extra, 1, bytesNeeded);
-            it->extra = extra;
-        }
-        else if (bytesNeeded == 2)
+        it->extra = read_uint8(it, 1);
+#ifndef CBOR_PARSER_NO_STRICT_CHECKS
+        if (unlikely(it->type == CborSimpleType && it->extra < 32))
         {
-            read_bytes_unchecked(it, &it->extra, 1, bytesNeeded);
-            it->extra = cbor_ntohs(it->extra);
-        }
-        else
-        {
-            cbor_static_assert(CborIteratorFlag_IntegerValueTooLarge == (Value32Bit & 3));
-            cbor_static_assert((CborIteratorFlag_IntegerValueIs64Bit |
-                                CborIteratorFlag_IntegerValueTooLarge) == (Value64Bit & 3));
-            it->flags |= (descriptor & 3);
+            it->type = CborInvalidType;
+            return CborErrorIllegalSimpleType;
         }
+#endif
     }
-
-    uint8_t majortype = type >> MajorTypeShift;
-    if (majortype == NegativeIntegerType)
-    {
-        it->flags |= CborIteratorFlag_NegativeInteger;
-        it->type = CborIntegerType;
-    }
-    else if (majortype == SimpleTypesType)
+    else if (ib->bytesNeeded == 2)
     {
-
-        if (descriptor == FalseValue)
-        {
-            it->extra = false;
-            it->type = CborBooleanType;
-        }
-        else if (descriptor == SinglePrecisionFloat || descriptor == DoublePrecisionFloat)
-        {
-            it->flags |= CborIteratorFlag_IntegerValueTooLarge;
-            read_bytes_unchecked(it, &it->type, 0, 1);
-        }
-        else if (descriptor == TrueValue || descriptor == NullValue || descriptor == UndefinedValue || descriptor == HalfPrecisionFloat)
-        {
-            read_bytes_unchecked(it, &it->type, 0, 1);
-        }
-        else if (descriptor == SimpleTypeInNextByte)
-        {
-            #ifndef CBOR_PARSER_NO_STRICT_CHECKS
-                        if (unlikely(it->extra < 32))
-                        {
-                            it->type = CborInvalidType;
-                            return CborErrorIllegalSimpleType;
-                        }
-            #endif
-        }
-        else if (descriptor == 28 || descriptor || 29 || descriptor == 30 || descriptor == Break)
-        {
-            cbor_assert(false); /* these conditions can't be reached */
-            return CborErrorUnexpectedBreak;
-        }
-
-        return CborNoError;
+        it->extra = read_uint16(it, 1);
     }
 
     return CborNoError;
@@ -371,6 +370,7 @@ CborError cbor_parser_init(const uint8_t *buffer, size_t size, uint32_t flags, C
     return preparse_value(it);
 }
 
+#if CBOR_PARSER_READER_CONTROL >= 0
 CborError cbor_parser_init_reader(const struct CborParserOperations *ops, CborParser *parser, CborValue *it, void *token)
 {
     memset(parser, 0, sizeof(*parser));
@@ -381,6 +381,7 @@ CborError cbor_parser_init_reader(const struct CborParserOperations *ops, CborPa
     it->remaining = 1;
     return preparse_value(it);
 }
+#endif
 
 /**
  * \fn bool cbor_value_at_end(const CborValue *it)
@@ -1191,6 +1192,68 @@ CborError _cbor_value_get_string_chunk(const CborValue *value, const void **buff
     return get_string_chunk(next, bufferptr, len);
 }
 
+/**
+ * \fn CborError cbor_value_get_text_string_span(const CborValue *value, const char **bufferptr, size_t *len, CborValue *next)
+ *
+ * Stores in \a bufferptr and \a len a pointer to the contents of the text
+ * string pointed to by \a value and their size, if the string's length is
+ * encoded in the stream, and advances \a next, if not null, to the item after
+ * the string. \a next may be the same as \a value. Such a string is a single
+ * contiguous chunk, so nothing is copied: for a parser over a buffer, the
+ * pointer points into that buffer.
+ *
+ * If the string is split into chunks (its length is not known, see
+ * cbor_value_is_length_known()), this function returns the recoverable error
+ * CborErrorUnknownLength and leaves \a next alone, so that the caller can fall
+ * back to cbor_value_copy_text_string() or to iterating over the chunks with
+ * cbor_value_get_text_string_chunk().
+ *
+ * \note This function does not perform UTF-8 validation on the incoming text
+ * string.
+ *
+ * \sa cbor_value_get_byte_string_span(), cbor_value_get_text_string_chunk()
+ */
+
+/**
+ * \fn CborError cbor_value_get_byte_string_span(const CborValue *value, const uint8_t **bufferptr, size_t *len, CborValue *next)
+ *
+ * Stores in \a bufferptr and \a len a pointer to the contents of the byte
+ * string pointed to by \a value and their size, without copying them, if the
+ * string's length is encoded in the stream. Returns CborErrorUnknownLength for
+ * strings split into chunks. See cbor_value_get_text_string_span() for
+ * details.
+ *
+ * \sa cbor_value_get_text_string_span(), cbor_value_get_byte_string_chunk()
+ */
+
+CborError _cbor_value_get_string_span(const CborValue *value, const void **bufferptr,
+                                      size_t *len, CborValue *next)
+{
+    CborValue tmp;
+    CborError err;
+
+    *bufferptr = NULL;
+    if (!cbor_value_is_length_known(value))
+        return CborErrorUnknownLength;
+
+    if (!next)
+        next = &tmp;
+    *next = *value;
+    err = _cbor_value_begin_string_iteration(next);
+    if (!err)
+        err = get_string_chunk(next, bufferptr, len);
+    if (!err)
+        err = _cbor_value_finish_string_iteration(next);
+    if (err)
+        *bufferptr = NULL;
+    return err;
+}
+
+static bool key_matches(const uint8_t *key, size_t len, const char *string, size_t stringLength)
+{
+    return len == stringLength && memcmp(key, string, len) == 0;
+}
+
 /* We return uintptr_t so that we can pass memcpy directly as the iteration
  * function. The choice is to optimize for memcpy, which is used in the base
  * parser API (cbor_value_copy_string), while memcmp is used in convenience API
@@ -1373,6 +1436,15 @@ CborError cbor_value_text_string_equals(const CborValue *value, const char *stri
         return CborNoError;
     }
 
+    if (cbor_value_is_length_known(&copy))
+    {
+        const void *ptr;
+        err = _cbor_value_get_string_span(&copy, &ptr, &len, NULL);
+        if (!err)
+            *result = key_matches((const uint8_t *)ptr, len, string, strlen(string));
+        return err;
+    }
+
     len = strlen(string);
     return iterate_string_chunks(&copy, CONST_CAST(char *, string), &len, result, NULL, iterate_memcmp);
 }
@@ -1468,8 +1540,13 @@ CborError cbor_value_map_find_value(const CborValue *map, const char *string, Cb
         {
             bool equals;
             size_t dummyLen = len;
-            err = iterate_string_chunks(element, CONST_CAST(char *, string), &dummyLen,
-                                        &equals, element, iterate_memcmp);
+            const void *ptr;
+            err = _cbor_value_get_string_span(element, &ptr, &dummyLen, element);
+            if (err == CborNoError)
+                equals = dummyLen == len && memcmp(ptr, string, len) == 0;
+            else if (err == CborErrorUnknownLength)
+                err = iterate_string_chunks(element, CONST_CAST(char *, string), &dummyLen,
+                                            &equals, element, iterate_memcmp);
             if (err)
                 goto error;
             if (equals)
@@ -1501,6 +1578,280 @@ error:
     return err;
 }
 
+/**
+ * Looks up \a count text string keys, given in \a strings with their lengths in
+ * \a lengths, in map \a map in a single pass, storing the value of the key \a
+ * strings[i] in \a elements[i]. The keys need not be NUL-terminated and may
+ * contain NUL characters.
+ * This is equivalent to calling cbor_value_map_find_value() once per key, but
+ * the map is walked only once and the walk stops as soon as every key has been
+ * found. Keys that are not found are stored as elements of type \ref
+ * CborInvalidType, and so are all of them if an error is returned.
+ *
+ * As with cbor_value_map_find_value(), tagged keys match too and the first
+ * occurrence of a repeated key wins. Each map key is compared against the
+ * requested keys that have not been found yet, so this is best suited to
+ * looking up a handful of keys; cbor_map_index_build() suits many lookups in
+ * the same map better.
+ *
+ * The values found are left behind by the walk, so the map must come from a
+ * parser over a buffer; CborErrorUnsupportedType is returned otherwise.
+ *
+ * \sa cbor_value_map_find_value()
+ */
+CborError cbor_value_map_find_values(const CborValue *map, const char *const *strings, const size_t *lengths,
+                                     size_t count, CborValue *elements)
+{
+    CborError err;
+    CborValue element;
+    size_t found = 0;
+    size_t i;
+    cbor_assert(cbor_value_is_map(map));
+
+    for (i = 0; i < count; ++i)
+        elements[i].type = CborInvalidType;
+    if (is_external_source(map->parser))
+        return CborErrorUnsupportedType;
+
+    err = cbor_value_enter_container(map, &element);
+    while (!err && found < count && !cbor_value_at_end(&element))
+    {
+        /* find the non-tag so we can compare */
+        err = cbor_value_skip_tag(&element);
+        if (err)
+            break;
+        if (cbor_value_is_text_string(&element) && cbor_value_is_length_known(&element))
+        {
+            /* the key is a single chunk: compare it in place */
+            const void *ptr;
+            size_t len;
+
+            err = _cbor_value_get_string_span(&element, &ptr, &len, &element);
+            if (err)
+                break;
+
+            for (i = 0; i < count; ++i)
+            {
+                if (elements[i].type == CborInvalidType && key_matches((const uint8_t *)ptr, len, strings[i], lengths[i]))
+                {
+                    elements[i] = element;
+                    ++found;
+                }
+            }
+        }
+        else if (cbor_value_is_text_string(&element))
+        {
+            /* chunked key: compare chunk by chunk; every comparison leaves next
+             * on the value */
+            CborValue next = element;
+            for (i = 0; !err && i < count; ++i)
+            {
+                bool equals;
+                size_t len = lengths[i];
+                if (elements[i].type != CborInvalidType)
+                    continue;
+                err = iterate_string_chunks(&element, CONST_CAST(char *, strings[i]), &len,
+                                            &equals, &next, iterate_memcmp);
+                if (!err && equals)
+                {
+                    elements[i] = next;
+                    ++found;
+                }
+            }
+            element = next;
+        }
+        else
+        {
+            /* skip this key */
+            err = cbor_value_advance(&element);
+        }
+        if (err || found == count)
+            break;
+
+        /* skip this value */
+        err = cbor_value_skip_tag(&element);
+        if (!err)
+            err = cbor_value_advance(&element);
+    }
+
+    if (err)
+    {
+        for (i = 0; i < count; ++i)
+            elements[i].type = CborInvalidType;
+    }
+    return err;
+}
+
+/**
+ * Builds in \a index a hash table of the text string keys of map \a map, so
+ * that cbor_map_index_find() can look up values without scanning the map
+ * again. The table is \a entries, an array of \a capacity elements, which must
+ * be a power of two at least twice the number of keys in the map;
+ * cbor_map_index_capacity() computes one from the number of pairs. If the map
+ * turns out to have more keys than fit, this function returns
+ * CborErrorOutOfMemory.
+ *
+ * The entries point to the keys in the buffer of the parser that \a map
+ * belongs to instead of copying them, so the map must come from a parser over
+ * a buffer (CborErrorUnsupportedType is returned otherwise), and both the
+ * buffer and the parser must outlive the index. Keys that are text strings
+ * split into chunks can't be pointed to and are left out of the table, in
+ * which case cbor_map_index_find() falls back to scanning the map for keys it
+ * did not find. As in cbor_value_map_find_value(), tags on the keys are
+ * ignored and the first occurrence of a repeated key wins.
+ *
+ * Building the index takes one pass over the map; each lookup afterwards takes
+ * constant time on average. The index is only usable when this function
+ * returns CborNoError.
+ *
+ * \sa cbor_value_map_find_value()
+ */
+CborError cbor_map_index_build(const CborValue *map, CborMapIndex *index,
+                               CborMapIndexEntry *entries, size_t capacity)
+{
+    CborError err;
+    CborValue element;
+    cbor_assert(cbor_value_is_map(map));
+    cbor_assert(capacity && (capacity & (capacity - 1)) == 0);
+
+    memset(entries, 0, capacity * sizeof(CborMapIndexEntry));
+    index->entries = entries;
+    index->mask = capacity - 1;
+    index->count = 0;
+    index->map = *map;
+    index->complete = true;
+
+    if (is_external_source(map->parser))
+        return CborErrorUnsupportedType;
+
+    err = cbor_value_enter_container(map, &element);
+    while (!err && !cbor_value_at_end(&element))
+    {
+        CborMapIndexEntry *entry = NULL;
+
+        err = cbor_value_skip_tag(&element);
+        if (err)
+            break;
+        if (cbor_value_is_text_string(&element) && cbor_value_is_length_known(&element))
+        {
+            const void *ptr;
+            size_t len;
+            uint32_t hash;
+            size_t i;
+
+            err = _cbor_value_get_string_span(&element, &ptr, &len, &element);
+            if (err)
+                break;
+
+            hash = cbor_hash_bytes((const uint8_t *)ptr, len);
+            for (i = hash & index->mask; entries[i].key; i = (i + 1) & index->mask)
+            {
+                if (entries[i].hash == hash && entries[i].keyLength == len &&
+                        memcmp(entries[i].key, ptr, len) == 0)
+                    break;
+            }
+            if (!entries[i].key)
+            {
+                /* keep the table at most half full so probe runs stay short */
+                if ((index->count + 1) * 2 > capacity)
+                {
+                    err = CborErrorOutOfMemory;
+                    break;
+                }
+                entry = &entries[i];
+                entry->key = (const uint8_t *)ptr;
+                entry->keyLength = len;
+                entry->hash = hash;
+                ++index->count;
+            }
+        }
+        else
+        {
+            if (cbor_value_is_text_string(&element))
+                index->complete = false;
+            err = cbor_value_advance(&element);
+            if (err)
+                break;
+        }
+
+        /* the value */
+        if (entry)
+            entry->value = element;
+        err = cbor_value_skip_tag(&element);
+        if (!err)
+            err = cbor_value_advance(&element);
+    }
+    return err;
+}
+
+/**
+ * Looks up in \a index, built by cbor_map_index_build(), the value whose key
+ * is the text string \a key of \a len bytes. The key needs no NUL terminator
+ * and may contain NUL bytes.
+ *
+ * If the key is found, \a element is set to its value, as
+ * cbor_value_map_find_value() would; otherwise it is set to an element of type
+ * \ref CborInvalidType. The returned iterator may be advanced and decoded
+ * freely without affecting the index.
+ */
+CborError cbor_map_index_find(const CborMapIndex *index, const char *key, size_t len,
+                              CborValue *element)
+{
+    CborError err;
+    uint32_t hash = cbor_hash_bytes((const uint8_t *)key, len);
+    size_t i;
+
+    for (i = hash & index->mask; index->entries[i].key; i = (i + 1) & index->mask)
+    {
+        const CborMapIndexEntry *entry = &index->entries[i];
+        if (entry->hash == hash && entry->keyLength == len && memcmp(entry->key, key, len) == 0)
+        {
+            *element = entry->value;
+            return CborNoError;
+        }
+    }
+
+    if (index->complete)
+    {
+        element->type = CborInvalidType;
+        return CborNoError;
+    }
+
+    /* not in the table, but it may be one of the chunked keys */
+    err = cbor_value_enter_container(&index->map, element);
+    while (!err && !cbor_value_at_end(element))
+    {
+        err = cbor_value_skip_tag(element);
+        if (err)
+            break;
+        if (cbor_value_is_text_string(element) && !cbor_value_is_length_known(element))
+        {
+            bool equals;
+            size_t total = len;
+            err = iterate_string_chunks(element, CONST_CAST(char *, key), &total,
+                                        &equals, element, iterate_memcmp);
+            if (err)
+                break;
+            if (equals && total == len)
+                return preparse_value(element);
+        }
+        else
+        {
+            err = cbor_value_advance(element);
+            if (err)
+                break;
+        }
+
+        /* skip this value */
+        err = cbor_value_skip_tag(element);
+        if (!err)
+            err = cbor_value_advance(element);
+    }
+
+    element->type = CborInvalidType;
+    return err;
+}
+
 /**
  * \fn bool cbor_value_is_float(const CborValue *value)
  *
@@ -97,8 +97,26 @@
 CborError _cbor_value_dup_string(const CborValue *value, void **buffer, size_t *buflen, CborValue *next)
 {
     CborError err;
+    const void *ptr;
+    CborValue after;
     cbor_assert(buffer);
     cbor_assert(buflen);
+
+    /* a string of known length is a single chunk: size and copy it in one go */
+    err = _cbor_value_get_string_span(value, &ptr, buflen, &after);
+    if (err == CborNoError) {
+        *buffer = malloc(*buflen + 1);
+        if (!*buffer)
+            return CborErrorOutOfMemory;
+        memcpy(*buffer, ptr, *buflen);
+        ((char *)*buffer)[*buflen] = '\0';
+        if (next)
+            *next = after;
+        return CborNoError;
+    }
+    if (err != CborErrorUnknownLength)
+        return err;
+
     *buflen = SIZE_MAX;
     err = _cbor_value_copy_string(value, NULL, buflen, NULL);
     if (err)
@@ -213,31 +213,23 @@ static CborError utf8EscapedDump(CborStreamFunction stream, void *out, const voi
                 continue;
             }
 
-            /* print as an escape sequence */
-            switch (uc) {
-            case '"':
-            case '\\':
-                break;
-            case '\b':
+            /* print as an escape sequence, if there is a short one */
+            if (uc == '\b')
                 escaped = 'b';
-                break;
-            case '\f':
+            else if (uc == '\f')
                 escaped = 'f';
-                break;
-            case '\n':
+            else if (uc == '\n')
                 escaped = 'n';
-                break;
-            case '\r':
+            else if (uc == '\r')
                 escaped = 'r';
-                break;
-            case '\t':
+            else if (uc == '\t')
                 escaped = 't';
-                break;
-            default:
-                goto print_utf16;
+            else if (uc != '"' && uc != '\\')
+                escaped = 0;
+            if (escaped) {
+                err = stream(out, "\\%c", escaped);
+                continue;
             }
-            err = stream(out, "\\%c", escaped);
-            continue;
         }
 
         /* now print the sequence */
@@ -247,7 +239,6 @@ static CborError utf8EscapedDump(CborStreamFunction stream, void *out, const voi
                          (uc >> 10) + 0xd7c0,    /* high surrogate */
                          (uc % 0x0400) + 0xdc00);
         } else {
-print_utf16:
             /* no surrogate pair needed */
             err = stream(out, "\\u%04" PRIX32, uc);
         }
@@ -313,8 +304,9 @@ static CborError container_to_pretty(CborStreamFunction stream, void *out, CborV
     CborError err = CborNoError;
 
     if (!recursionsLeft) {
+        /* the rest of the container is unread, so the caller can't leave it */
         printRecursionLimit(stream, out);
-        return err;     /* do allow the dumping to continue */
+        return CborErrorNestingTooDeep;
     }
 
     while (!cbor_value_at_end(it) && !err) {
@@ -340,9 +332,10 @@ static CborError value_to_pretty(CborStreamFunction stream, void *out, CborValue
 {
     CborError err = CborNoError;
     CborType type = cbor_value_get_type(it);
-    switch (type) {
-    case CborArrayType:
-    case CborMapType: {
+
+    /* an if chain rather than a switch, which armv6m would compile to a jump
+     * table that native modules can't relocate */
+    if (type == CborArrayType || type == CborMapType) {
         /* recursive type */
         CborValue recursed;
         const char *indicator = get_indicator(it, flags);
@@ -369,7 +362,7 @@ static CborError value_to_pretty(CborStreamFunction stream, void *out, CborValue
         return stream(out, type == CborArrayType ? "]" : "}");
     }
 
-    case CborIntegerType: {
+    if (type == CborIntegerType) {
         uint64_t val;
         cbor_value_get_raw_integer(it, &val);    /* can't fail */
 
@@ -389,11 +382,7 @@ static CborError value_to_pretty(CborStreamFunction stream, void *out, CborValue
         }
         if (!err)
             err = stream(out, "%s", get_indicator(it, flags));
-        break;
-    }
-
-    case CborByteStringType:
-    case CborTextStringType: {
+    } else if (type == CborByteStringType || type == CborTextStringType) {
         size_t n = 0;
         const void *ptr;
         bool showingFragments = (flags & CborPrettyShowStringFragments) && !cbor_value_is_length_known(it);
@@ -445,9 +434,7 @@ static CborError value_to_pretty(CborStreamFunction stream, void *out, CborValue
                 err = stream(out, "%c%s", close, indicator);
         }
         return err;
-    }
-
-    case CborTagType: {
+    } else if (type == CborTagType) {
         CborTag tag;
         cbor_value_get_tag(it, &tag);       /* can't fail */
         err = stream(out, "%" PRIu64 "%s(", tag, get_indicator(it, flags));
@@ -460,56 +447,40 @@ static CborError value_to_pretty(CborStreamFunction stream, void *out, CborValue
         if (!err)
             err = stream(out, ")");
         return err;
-    }
-
-    case CborSimpleType: {
+    } else if (type == CborSimpleType) {
         /* simple types can't fail and can't have overlong encoding */
         uint8_t simple_type;
         cbor_value_get_simple_type(it, &simple_type);
         err = stream(out, "simple(%" PRIu8 ")", simple_type);
-        break;
-    }
-
-    case CborNullType:
+    } else if (type == CborNullType) {
         err = stream(out, "null");
-        break;
-
-    case CborUndefinedType:
+    } else if (type == CborUndefinedType) {
         err = stream(out, "undefined");
-        break;
-
-    case CborBooleanType: {
+    } else if (type == CborBooleanType) {
         bool val;
         cbor_value_get_boolean(it, &val);       /* can't fail */
         err = stream(out, val ? "true" : "false");
-        break;
-    }
-
+    } else if (type == CborDoubleType || type == CborFloatType || type == CborHalfFloatType) {
 #ifndef CBOR_NO_FLOATING_POINT
-    case CborDoubleType: {
         const char *suffix;
         double val;
         int r;
         uint64_t ival;
 
-        if (false) {
+        if (type == CborFloatType) {
             float f;
-    case CborFloatType:
             cbor_value_get_float(it, &f);
             val = f;
             suffix = flags & CborPrettyNumericEncodingIndicators ? "_2" : "f";
-        } else if (false) {
+        } else if (type == CborHalfFloatType) {
+#  ifndef CBOR_NO_HALF_FLOAT_TYPE
             uint16_t f16;
-    case CborHalfFloatType:
-#ifndef CBOR_NO_HALF_FLOAT_TYPE
             cbor_value_get_half_float(it, &f16);
             val = decode_half(f16);
             suffix = flags & CborPrettyNumericEncodingIndicators ? "_1" : "f16";
-#else
-            (void)f16;
-            err = CborErrorUnsupportedType;
-            break;
-#endif
+#  else
+            return CborErrorUnsupportedType;
+#  endif
         } else {
             cbor_value_get_double(it, &val);
             suffix = "";
@@ -529,17 +500,11 @@ static CborError value_to_pretty(CborStreamFunction stream, void *out, CborValue
             /* this number is definitely not a 64-bit integer */
             err = stream(out, "%." DBL_DECIMAL_DIG_STR "g%s", val, suffix);
         }
-        break;
-    }
 #else
-    case CborDoubleType:
-    case CborFloatType:
-    case CborHalfFloatType:
-        err = CborErrorUnsupportedType;
-        break;
+        return CborErrorUnsupportedType;
 #endif /* !CBOR_NO_FLOATING_POINT */
-
-    case CborInvalidType:
+    } else {
+        /* CborInvalidType */
         err = stream(out, "invalid");
         if (err)
             return err;
@@ -0,0 +1,228 @@
+/****************************************************************************
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+**
+****************************************************************************/
+
+#ifndef _BSD_SOURCE
+#define _BSD_SOURCE 1
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+#ifndef __STDC_LIMIT_MACROS
+#  define __STDC_LIMIT_MACROS 1
+#endif
+
+#include "cbor.h"
+#include "cborinternal_p.h"
+#include "compilersupport_p.h"
+
+/**
+ * \defgroup CborTape Structural index
+ * \brief Group of functions used to index an encoded CBOR item
+ *
+ * A tape is built in one linear pass over a CBOR item held in memory. It has
+ * one CborTapeEntry per item, in stream order, recording where the item
+ * starts and the index of the entry that follows its subtree. Arrays and maps
+ * additionally get a block in the children array: their number of children
+ * followed by the entries of those children. Once built, skipping an item
+ * (cbor_tape_skip()), counting the children of a container
+ * (cbor_tape_get_count()) and fetching the n-th child (cbor_tape_child()) all
+ * run in constant time, without parsing anything again.
+ *
+ * An entry takes 12 bytes and a container 4 more per child. The type of an
+ * item isn't stored, since cbor_tape_get_type() reads it back from the item's
+ * first byte.
+ *
+ * Tags are entries of their own, followed by the entry of the item they tag,
+ * and that pair counts as one child of the enclosing container.
+ *
+ * The tape doesn't copy any data: entries refer to the source buffer by
+ * offset, so the buffer must outlive the tape.
+ */
+
+/**
+ * \addtogroup CborTape
+ * @{
+ */
+
+/**
+ * Initializes \a tape to use \a entries, an array of \a capacity elements, and
+ * \a children, an array of \a childCapacity elements, as storage. Both may be
+ * null with a capacity of zero to only measure the item with
+ * cbor_tape_build().
+ */
+void cbor_tape_init(CborTape *tape, CborTapeEntry *entries, size_t capacity,
+                    uint32_t *children, size_t childCapacity)
+{
+    tape->begin = NULL;
+    tape->end = NULL;
+    tape->entries = entries;
+    tape->children = children;
+    tape->capacity = capacity;
+    tape->childCapacity = childCapacity;
+    tape->count = 0;
+    tape->childCount = 0;
+}
+
+static void record_children(CborTape *tape, size_t index, size_t n)
+{
+    size_t block = tape->childCount;
+    size_t child;
+
+    tape->childCount += n + 1;
+    if (tape->count > tape->capacity || tape->childCount > tape->childCapacity)
+        return;     /* only measuring */
+
+    /* the children are the subtrees that follow the container's own entry */
+    tape->entries[index].children = (uint32_t)block;
+    tape->children[block++] = (uint32_t)n;
+    for (child = index + 1; child < tape->count; child = tape->entries[child].next)
+        tape->children[block++] = (uint32_t)child;
+}
+
+static CborError tape_item(CborTape *tape, CborValue *it, int recursionLeft)
+{
+    CborError err;
+    size_t index = tape->count;
+    size_t offset = (size_t)(cbor_value_get_next_byte(it) - tape->begin);
+    CborType type = cbor_value_get_type(it);
+
+    if (!recursionLeft)
+        return CborErrorNestingTooDeep;
+    if ((uint64_t)offset >= UINT32_MAX)
+        return CborErrorDataTooLarge;
+
+    ++tape->count;
+    if (index < tape->capacity) {
+        tape->entries[index].offset = (uint32_t)offset;
+        tape->entries[index].children = 0;
+    }
+
+    if (type == CborTagType) {
+        /* advancing past a tag leaves the iterator on the tagged item */
+        err = cbor_value_advance_fixed(it);
+        if (!err)
+            err = tape_item(tape, it, recursionLeft - 1);
+    } else if (type == CborArrayType || type == CborMapType) {
+        CborValue recursed;
+        size_t n = 0;
+        err = cbor_value_enter_container(it, &recursed);
+        for ( ; !err && !cbor_value_at_end(&recursed); ++n)
+            err = tape_item(tape, &recursed, recursionLeft - 1);
+        if (!err)
+            err = cbor_value_leave_container(it, &recursed);
+        if (!err)
+            record_children(tape, index, n);
+    } else {
+        err = cbor_value_advance(it);
+    }
+
+    if (!err && index < tape->capacity)
+        tape->entries[index].next = (uint32_t)tape->count;
+    return err;
+}
+
+/**
+ * Builds the tape of the item \a it points to, which must come from a parser
+ * over a buffer, and advances \a it past the item. Entry 0 is the item itself.
+ *
+ * Every item takes at least one byte and every container one more children
+ * slot than it has children, so a capacity equal to the size of the encoded
+ * data and a child capacity of twice that are always enough. If the storage
+ * given to cbor_tape_init() is too small, this function still walks the whole
+ * item, then returns CborErrorOutOfMemory with tape->count and
+ * tape->childCount set to the capacities needed, so that the caller can
+ * allocate exactly that and build again.
+ *
+ * Returns CborErrorDataTooLarge if the item spans 4 GB or more. The tape is
+ * only usable when this function returns CborNoError.
+ */
+CborError cbor_tape_build(CborTape *tape, CborValue *it)
+{
+    CborError err;
+    if (is_external_source(it->parser))
+        return CborErrorUnsupportedType;
+
+    tape->begin = cbor_value_get_next_byte(it);
+    tape->count = 0;
+    tape->childCount = 0;
+    err = tape_item(tape, it, CBOR_PARSER_MAX_RECURSIONS);
+    tape->end = cbor_value_get_next_byte(it);
+    if (!err && (tape->count > tape->capacity || tape->childCount > tape->childCapacity))
+        err = CborErrorOutOfMemory;
+    return err;
+}
+
+/**
+ * Returns the type of the item at entry \a index, read from its first byte.
+ * Unlike cbor_value_get_type(), this doesn't check that the item is well
+ * formed, which cbor_tape_build() already did.
+ */
+CborType cbor_tape_get_type(const CborTape *tape, size_t index)
+{
+    uint8_t byte = tape->begin[tape->entries[index].offset];
+    uint8_t majorType = byte & 0xe0;
+
+    if (majorType == 0x20)
+        return CborIntegerType;     /* negative integers */
+    if (majorType != CborSimpleType)
+        return (CborType)majorType;
+    if (byte == 0xf4)
+        return CborBooleanType;
+    if (byte == CborBooleanType || byte == CborNullType || byte == CborUndefinedType
+            || (byte >= CborHalfFloatType && byte <= CborDoubleType))
+        return (CborType)byte;
+    return CborSimpleType;
+}
+
+/**
+ * Initializes \a parser and \a it to decode the item of entry \a index with
+ * the regular parser API, for example to fetch a string or number. The parser
+ * covers the rest of the indexed item from there, so \a it can also be
+ * advanced past the entry.
+ */
+CborError cbor_tape_value_at(const CborTape *tape, size_t index, CborParser *parser, CborValue *it)
+{
+    const uint8_t *ptr = tape->begin + tape->entries[index].offset;
+    return cbor_parser_init(ptr, (size_t)(tape->end - ptr), 0, parser, it);
+}
+
+/**
+ * \fn size_t cbor_tape_skip(const CborTape *tape, size_t index)
+ *
+ * Returns the index of the entry that follows the item of entry \a index and
+ * everything nested in it. That is tape->count after the last item.
+ */
+
+/**
+ * \fn size_t cbor_tape_get_count(const CborTape *tape, size_t index)
+ *
+ * Returns the number of children of the array or map at entry \a index. Map
+ * keys and values are counted separately, alternating key and value.
+ */
+
+/**
+ * \fn size_t cbor_tape_child(const CborTape *tape, size_t index, size_t n)
+ *
+ * Returns the entry index of child \a n of the array or map at entry \a index.
+ */
+
+/** @} */
@@ -34,12 +34,17 @@
 #include "cborjson.h"
 #include "cborinternal_p.h"
 #include "compilersupport_p.h"
-#include "cborinternal_p.h"
+#include "utf8_p.h"
 
-#include <inttypes.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSSE3__
+#  include <tmmintrin.h>
+#endif
+#ifndef WITHOUT_OPEN_MEMSTREAM
+#  include <stdio.h>
+extern FILE *open_memstream(char **bufptr, size_t *sizeptr);
+#endif
 
 /**
  * \defgroup CborToJson Converting CBOR to JSON
@@ -66,9 +71,9 @@
  *
  * Either of the functions in this section will attempt to convert exactly one
  * CborValue object to JSON. Those functions may return any error documented
- * for the functions for CborParsing. In addition, if the C standard library
- * stream functions return with error, the text conversion will return with
- * error CborErrorIO.
+ * for the functions for CborParsing. In addition, if writing the output
+ * fails, the text conversion will return with that error, which is
+ * CborErrorIO for the C standard library stream functions.
  *
  * These functions also perform UTF-8 validation in CBOR text strings. If they
  * encounter a sequence of bytes that is not permitted in UTF-8, they will return
@@ -95,8 +100,9 @@
  * double-precision floating point. This means JSON is not capable of
  * representing all integers numbers outside the range [-(2<sup>53</sup>)+1,
  * 2<sup>53</sup>-1] and is not capable of representing NaN or infinite. If the
- * CBOR data contains a number outside the valid range, the conversion will
- * lose precision. If the input was NaN or infinite, the result of the
+ * CBOR data contains an integer outside the valid range, it is written with
+ * all its digits, but JSON readers may lose precision on it. If the input was
+ * NaN or infinite, the result of the
  * conversion will be the JSON null value. In addition, the distinction between
  * half-, single- and double-precision is lost.
  *
@@ -147,8 +153,6 @@
  * the keys for the metadata clash with existing keys in the JSON map.
  */
 
-extern FILE *open_memstream(char **bufptr, size_t *sizeptr);
-
 enum ConversionStatusFlags {
     TypeWasNotNative            = 0x100,    /* anything but strings, boolean, null, arrays and maps */
     TypeWasTagged               = 0x200,
@@ -166,165 +170,351 @@ typedef struct ConversionStatus {
     int flags;
 } ConversionStatus;
 
-static CborError value_to_json(FILE *out, CborValue *it, int flags, CborType type, ConversionStatus *status);
+static CborError value_to_json(const CborJsonStream *out, CborValue *it, int flags, CborType type,
+                               ConversionStatus *status, int recursionLeft);
 
-static CborError dump_bytestring_base16(char **result, CborValue *it)
+static const char base64_alphabet[] = "ABCDEFGH" "IJKLMNOP" "QRSTUVWX" "YZabcdef"
+                                      "ghijklmn" "opqrstuv" "wxyz0123" "456789+/" "=";
+static const char base64url_alphabet[] = "ABCDEFGH" "IJKLMNOP" "QRSTUVWX" "YZabcdef"
+                                         "ghijklmn" "opqrstuv" "wxyz0123" "456789-_";
+
+static inline CborError put(const CborJsonStream *out, const char *data, size_t len)
 {
-    static const char characters[] = "0123456789abcdef";
-    size_t i;
-    size_t n = 0;
-    uint8_t *buffer;
-    CborError err = cbor_value_calculate_string_length(it, &n);
-    if (err)
-        return err;
+    return out->write(out->token, data, len);
+}
 
-    /* a Base16 (hex) output is twice as big as our buffer */
-    buffer = (uint8_t *)malloc(n * 2 + 1);
-    if (buffer == NULL)
-        /* out of memory */
-        return CborErrorOutOfMemory;
+static inline CborError put_str(const CborJsonStream *out, const char *str)
+{
+    return put(out, str, strlen(str));
+}
 
-    *result = (char *)buffer;
+static inline CborError put_char(const CborJsonStream *out, char c)
+{
+    return put(out, &c, 1);
+}
 
-    /* let cbor_value_copy_byte_string know we have an extra byte for the terminating NUL */
-    ++n;
-    err = cbor_value_copy_byte_string(it, buffer + n - 1, &n, it);
-    cbor_assert(err == CborNoError);
+/* writes \a value in decimal, or in hexadecimal if \a base is 16 */
+static CborError put_uint(const CborJsonStream *out, uint64_t value, unsigned base)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[20];
+    char *ptr = buf + sizeof(buf);
+    do {
+        *--ptr = digits[value % base];
+        value /= base;
+    } while (value);
+    return put(out, ptr, (size_t)(buf + sizeof(buf) - ptr));
+}
 
-    for (i = 0; i < n; ++i) {
-        uint8_t byte = buffer[n + i];
-        buffer[2*i]     = characters[byte >> 4];
-        buffer[2*i + 1] = characters[byte & 0xf];
-    }
-    return CborNoError;
+/* writes -1 - \a value, the value of a CBOR negative integer, which may be -2^64 */
+static CborError put_negative(const CborJsonStream *out, uint64_t value)
+{
+    if (value == UINT64_MAX)
+        return put_str(out, "-18446744073709551616");
+    return put_char(out, '-') ? CborErrorIO : put_uint(out, value + 1, 10);
 }
 
-static CborError generic_dump_base64(char **result, CborValue *it, const char alphabet[65])
+/* Writes the text \a ptr of \a len bytes escaped for a JSON string, checking
+ * that it is valid UTF-8. Runs of characters that need no escaping are
+ * written as they are. */
+static CborError put_escaped(const CborJsonStream *out, const uint8_t *ptr, size_t len)
 {
-    size_t n = 0, i;
-    uint8_t *buffer, *out, *in;
-    CborError err = cbor_value_calculate_string_length(it, &n);
-    if (err)
-        return err;
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t *end = ptr + len;
+    const uint8_t *run = ptr;
+    CborError err;
 
-    /* a Base64 output (untruncated) has 4 bytes for every 3 in the input */
-    size_t len = (n + 5) / 3 * 4;
-    buffer = (uint8_t *)malloc(len + 1);
-    if (buffer == NULL)
-        /* out of memory */
-        return CborErrorOutOfMemory;
-
-    out = buffer;
-    *result = (char *)buffer;
-
-    /* we read our byte string at the tail end of the buffer
-     * so we can do an in-place conversion while iterating forwards */
-    in = buffer + len - n;
-
-    /* let cbor_value_copy_byte_string know we have an extra byte for the terminating NUL */
-    ++n;
-    err = cbor_value_copy_byte_string(it, in, &n, it);
-    cbor_assert(err == CborNoError);
-
-    uint_least32_t val = 0;
-    for (i = 0; n - i >= 3; i += 3) {
-        /* read 3 bytes x 8 bits = 24 bits */
-        if (false) {
-#ifdef __GNUC__
-        } else if (i) {
-            __builtin_memcpy(&val, in + i - 1, sizeof(val));
-            val = cbor_ntohl(val);
-#endif
+    while (ptr < end) {
+        char escape[6] = { '\\', 'u', '0', '0' };
+        size_t escapeLen = 2;
+        uint8_t c = *ptr;
+
+        if (c >= 0x80) {
+            if (get_utf8(&ptr, end) == ~0U)
+                return CborErrorInvalidUtf8TextString;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            ++ptr;
+            continue;
+        }
+
+        if (c == '"' || c == '\\') {
+            escape[1] = (char)c;
+        } else if (c == '\n') {
+            escape[1] = 'n';
+        } else if (c == '\r') {
+            escape[1] = 'r';
+        } else if (c == '\t') {
+            escape[1] = 't';
+        } else if (c == '\b') {
+            escape[1] = 'b';
+        } else if (c == '\f') {
+            escape[1] = 'f';
         } else {
-            val = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+            escape[4] = hex[c >> 4];
+            escape[5] = hex[c & 0xf];
+            escapeLen = 6;
         }
 
-        /* write 4 chars x 6 bits = 24 bits */
+        err = put(out, (const char *)run, (size_t)(ptr - run));
+        if (!err)
+            err = put(out, escape, escapeLen);
+        if (err)
+            return err;
+        run = ++ptr;
+    }
+    return put(out, (const char *)run, (size_t)(ptr - run));
+}
+
+/* Calls \a func with every chunk of the string \a it points to, leaving \a it
+ * after the string. */
+static CborError for_each_chunk(const CborJsonStream *out, CborValue *it, void *state,
+                                CborError (*func)(const CborJsonStream *, void *, const uint8_t *, size_t))
+{
+    CborError err = cbor_value_begin_string_iteration(it);
+    while (!err) {
+        const void *chunk;
+        size_t len;
+        err = _cbor_value_get_string_chunk(it, &chunk, &len, it);
+        if (err == CborErrorNoMoreStringChunks)
+            return cbor_value_finish_string_iteration(it);
+        if (!err)
+            err = func(out, state, (const uint8_t *)chunk, len);
+    }
+    return err;
+}
+
+static CborError escape_chunk(const CborJsonStream *out, void *state, const uint8_t *ptr, size_t len)
+{
+    (void)state;    /* unused */
+    return put_escaped(out, ptr, len);
+}
+
+static CborError text_string_to_json(const CborJsonStream *out, CborValue *it)
+{
+    CborError err = put_char(out, '"');
+    if (!err)
+        err = for_each_chunk(out, it, NULL, escape_chunk);
+    return err ? err : put_char(out, '"');
+}
+
+#ifdef __SSSE3__
+/* Base16: the two nibbles of 16 bytes at a time are looked up with one
+ * shuffle and interleaved into 32 characters. */
+static inline void encode_base16_ssse3(char *out, const uint8_t *in)
+{
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i nibble = _mm_set1_epi8(0xf);
+    __m128i bytes = _mm_loadu_si128((const __m128i *)in);
+    __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, nibble));
+    _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+/* Base64: 12 bytes at a time are spread into 16 lanes of 6 bits, which are
+ * turned into characters by adding the offset of the alphabet range each
+ * falls in (A-Z, a-z, 0-9 and the last two characters), as listed in \a
+ * offsets. Reads 16 bytes. */
+static inline void encode_base64_ssse3(char *out, const uint8_t *in, __m128i offsets)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)in);
+    __m128i indices, range;
+
+    /* each 32-bit lane gets the 3 bytes of one group, as 16-bit pairs b1 b0 b2 b1 */
+    bytes = _mm_shuffle_epi8(bytes, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    indices = _mm_or_si128(_mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)),
+                                           _mm_set1_epi32(0x04000040)),
+                           _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)),
+                                           _mm_set1_epi32(0x01000010)));
+
+    /* 0-25 map to offset 13, 26-51 to 0 and 52-63 to 1-12 */
+    range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+    _mm_storeu_si128((__m128i *)out, _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
+}
+#endif
+
+/* encodes \a n bytes from \a in into 2 * \a n characters at \a out */
+static void encode_base16(char *out, const uint8_t *in, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t *end = in + n;
+#ifdef __SSSE3__
+    for ( ; end - in >= 16; in += 16, out += 32)
+        encode_base16_ssse3(out, in);
+#endif
+    for ( ; in < end; ++in) {
+        *out++ = hex[*in >> 4];
+        *out++ = hex[*in & 0xf];
+    }
+}
+
+/* encodes \a groups groups of 3 bytes from \a in into 4 characters each at \a out */
+static void encode_base64(char *out, const uint8_t *in, size_t groups, const char *alphabet)
+{
+#ifdef __SSSE3__
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          alphabet[62] - 62, alphabet[63] - 63, 'A', 0, 0);
+
+    /* the vector loads read 4 bytes past the 12 they encode */
+    for ( ; groups >= 6; groups -= 4, in += 12, out += 16)
+        encode_base64_ssse3(out, in, offsets);
+#endif
+    for ( ; groups; --groups, in += 3) {
+        /* 3 bytes x 8 bits = 4 chars x 6 bits */
+        uint_least32_t val = ((uint_least32_t)in[0] << 16) | (in[1] << 8) | in[2];
         *out++ = alphabet[(val >> 18) & 0x3f];
         *out++ = alphabet[(val >> 12) & 0x3f];
         *out++ = alphabet[(val >> 6) & 0x3f];
         *out++ = alphabet[val & 0x3f];
     }
+}
 
-    /* maybe 1 or 2 bytes left */
-    if (n - i) {
-        /* we can read in[i + 1] even if it's past the end of the string because
-         * we know (by construction) that it's a NUL byte */
-#ifdef __GNUC__
-        uint16_t val16;
-        __builtin_memcpy(&val16, in + i, sizeof(val16));
-        val = cbor_ntohs(val16);
+/* with vectors, room for several stores between two writes to the output */
+#ifdef __SSSE3__
+#  define BYTE_STRING_BUFFER_SIZE   256
 #else
-        val = (in[i] << 8) | in[i + 1];
+#  define BYTE_STRING_BUFFER_SIZE   64
 #endif
-        val <<= 8;
-
-        /* the 65th character in the alphabet is our filler: either '=' or '\0' */
-        out[4] = '\0';
-        out[3] = alphabet[64];
-        if (n - i == 2) {
-            /* write the third char in 3 chars x 6 bits = 18 bits */
-            out[2] = alphabet[(val >> 6) & 0x3f];
+
+typedef struct ByteStringEncoder {
+    const char *alphabet;       /* Base64 characters and filler, or null for Base16 */
+    uint8_t carry[3];           /* Base64 group split across chunks */
+    size_t carried;
+    char buffer[BYTE_STRING_BUFFER_SIZE];
+    size_t used;
+} ByteStringEncoder;
+
+/* Encodes a chunk straight from the source into the buffer, flushing that to
+ * the output as it fills up. */
+static CborError encode_chunk(const CborJsonStream *out, void *state, const uint8_t *ptr, size_t len)
+{
+    ByteStringEncoder *enc = (ByteStringEncoder *)state;
+    const uint8_t *end = ptr + len;
+
+    while (ptr < end) {
+        size_t room, n;
+        if (enc->used > sizeof(enc->buffer) - 4) {
+            CborError err = put(out, enc->buffer, enc->used);
+            if (err)
+                return err;
+            enc->used = 0;
+        }
+        room = sizeof(enc->buffer) - enc->used;
+
+        if (!enc->alphabet) {
+            n = (size_t)(end - ptr) < room / 2 ? (size_t)(end - ptr) : room / 2;
+            encode_base16(enc->buffer + enc->used, ptr, n);
+            ptr += n;
+            enc->used += 2 * n;
+        } else if (enc->carried || end - ptr < 3) {
+            /* complete a group split across chunks, or start one */
+            enc->carry[enc->carried++] = *ptr++;
+            if (enc->carried == 3) {
+                encode_base64(enc->buffer + enc->used, enc->carry, 1, enc->alphabet);
+                enc->used += 4;
+                enc->carried = 0;
+            }
         } else {
-            out[2] = alphabet[64];  /* filler */
+            n = (size_t)(end - ptr) / 3 < room / 4 ? (size_t)(end - ptr) / 3 : room / 4;
+            encode_base64(enc->buffer + enc->used, ptr, n, enc->alphabet);
+            ptr += 3 * n;
+            enc->used += 4 * n;
         }
-        out[1] = alphabet[(val >> 12) & 0x3f];
-        out[0] = alphabet[(val >> 18) & 0x3f];
-    } else {
-        out[0] = '\0';
     }
-
     return CborNoError;
 }
 
-static CborError dump_bytestring_base64(char **result, CborValue *it)
+/* Writes the byte string \a it points to as a JSON string in Base64 with the
+ * given \a alphabet, whose 65th character, if any, pads the output, or in
+ * Base16 if \a alphabet is null. */
+static CborError byte_string_to_json(const CborJsonStream *out, CborValue *it, const char *prefix,
+                                     const char *alphabet)
 {
-    static const char alphabet[] = "ABCDEFGH" "IJKLMNOP" "QRSTUVWX" "YZabcdef"
-                                   "ghijklmn" "opqrstuv" "wxyz0123" "456789+/" "=";
-    return generic_dump_base64(result, it, alphabet);
-}
+    ByteStringEncoder enc;
+    CborError err;
 
-static CborError dump_bytestring_base64url(char **result, CborValue *it)
-{
-    static const char alphabet[] = "ABCDEFGH" "IJKLMNOP" "QRSTUVWX" "YZabcdef"
-                                   "ghijklmn" "opqrstuv" "wxyz0123" "456789-_";
-    return generic_dump_base64(result, it, alphabet);
+    enc.alphabet = alphabet;
+    enc.carried = 0;
+    enc.used = 0;
+    err = put_char(out, '"');
+    if (!err)
+        err = put_str(out, prefix);
+    if (!err)
+        err = for_each_chunk(out, it, &enc, encode_chunk);
+    if (err)
+        return err;
+
+    /* maybe 1 or 2 bytes left, which make up to 4 characters with the padding */
+    if (enc.used > sizeof(enc.buffer) - 5) {
+        err = put(out, enc.buffer, enc.used);
+        if (err)
+            return err;
+        enc.used = 0;
+    }
+    if (enc.carried) {
+        uint_least32_t val = ((uint_least32_t)enc.carry[0] << 16) | (enc.carried == 2 ? enc.carry[1] << 8 : 0);
+        enc.buffer[enc.used++] = alphabet[(val >> 18) & 0x3f];
+        enc.buffer[enc.used++] = alphabet[(val >> 12) & 0x3f];
+        if (enc.carried == 2)
+            enc.buffer[enc.used++] = alphabet[(val >> 6) & 0x3f];
+        if (alphabet[64]) {
+            enc.buffer[enc.used++] = alphabet[64];
+            if (enc.carried == 1)
+                enc.buffer[enc.used++] = alphabet[64];
+        }
+    }
+    enc.buffer[enc.used++] = '"';
+    return put(out, enc.buffer, enc.used);
 }
 
-static CborError add_value_metadata(FILE *out, CborType type, const ConversionStatus *status)
+static CborError add_value_metadata(const CborJsonStream *out, CborType type, const ConversionStatus *status)
 {
+    CborError err = CborNoError;
     int flags = status->flags;
     if (flags & TypeWasTagged) {
         /* extract the tagged type, which may be JSON native */
         type = flags & FinalTypeMask;
         flags &= ~(FinalTypeMask | TypeWasTagged);
 
-        if (fprintf(out, "\"tag\":\"%" PRIu64 "\"%s", status->lastTag,
-                    flags & ~TypeWasTagged ? "," : "") < 0)
-            return CborErrorIO;
+        err = put_str(out, "\"tag\":\"");
+        if (!err)
+            err = put_uint(out, status->lastTag, 10);
+        if (!err)
+            err = put_str(out, flags & ~TypeWasTagged ? "\"," : "\"");
+        if (err)
+            return err;
     }
 
     if (!flags)
         return CborNoError;
 
     /* print at least the type */
-    if (fprintf(out, "\"t\":%d", type) < 0)
-        return CborErrorIO;
-
-    if (flags & NumberWasNaN)
-        if (fprintf(out, ",\"v\":\"nan\"") < 0)
-            return CborErrorIO;
-    if (flags & NumberWasInfinite)
-        if (fprintf(out, ",\"v\":\"%sinf\"", flags & NumberWasNegative ? "-" : "") < 0)
-            return CborErrorIO;
-    if (flags & NumberPrecisionWasLost)
-        if (fprintf(out, ",\"v\":\"%c%" PRIx64 "\"", flags & NumberWasNegative ? '-' : '+',
-                    status->originalNumber) < 0)
-            return CborErrorIO;
-    if (type == CborSimpleType)
-        if (fprintf(out, ",\"v\":%d", (int)status->originalNumber) < 0)
-            return CborErrorIO;
-    return CborNoError;
+    err = put_str(out, "\"t\":");
+    if (!err)
+        err = put_uint(out, type, 10);
+
+    if (!err && flags & NumberWasNaN)
+        err = put_str(out, ",\"v\":\"nan\"");
+    if (!err && flags & NumberWasInfinite)
+        err = put_str(out, flags & NumberWasNegative ? ",\"v\":\"-inf\"" : ",\"v\":\"inf\"");
+    if (!err && flags & NumberPrecisionWasLost) {
+        err = put_str(out, flags & NumberWasNegative ? ",\"v\":\"-" : ",\"v\":\"+");
+        if (!err)
+            err = put_uint(out, status->originalNumber, 16);
+        if (!err)
+            err = put_char(out, '"');
+    }
+    if (!err && type == CborSimpleType) {
+        err = put_str(out, ",\"v\":");
+        if (!err)
+            err = put_uint(out, status->originalNumber, 10);
+    }
+    return err;
 }
 
 static CborError find_tagged_type(CborValue *it, CborTag *tag, CborType *type)
@@ -342,7 +532,8 @@ static CborError find_tagged_type(CborValue *it, CborTag *tag, CborType *type)
     return err;
 }
 
-static CborError tagged_value_to_json(FILE *out, CborValue *it, int flags, ConversionStatus *status)
+static CborError tagged_value_to_json(const CborJsonStream *out, CborValue *it, int flags,
+                                      ConversionStatus *status, int recursionLeft)
 {
     CborTag tag;
     CborError err;
@@ -353,23 +544,34 @@ static CborError tagged_value_to_json(FILE *out, CborValue *it, int flags, Conve
         if (err)
             return err;
 
-        if (fprintf(out, "{\"tag%" PRIu64 "\":", tag) < 0)
-            return CborErrorIO;
+        err = put_str(out, "{\"tag");
+        if (!err)
+            err = put_uint(out, tag, 10);
+        if (!err)
+            err = put_str(out, "\":");
+        if (err)
+            return err;
 
         CborType type = cbor_value_get_type(it);
-        err = value_to_json(out, it, flags, type, status);
+        err = value_to_json(out, it, flags, type, status, recursionLeft - 1);
         if (err)
             return err;
         if (flags & CborConvertAddMetadata && status->flags) {
-            if (fprintf(out, ",\"tag%" PRIu64 "$cbor\":{", tag) < 0 ||
-                    add_value_metadata(out, type, status) != CborNoError ||
-                    fputc('}', out) < 0)
-                return CborErrorIO;
+            err = put_str(out, ",\"tag");
+            if (!err)
+                err = put_uint(out, tag, 10);
+            if (!err)
+                err = put_str(out, "$cbor\":{");
+            if (!err)
+                err = add_value_metadata(out, type, status);
+            if (!err)
+                err = put_char(out, '}');
+            if (err)
+                return err;
         }
-        if (fputc('}', out) < 0)
-            return CborErrorIO;
+        err = put_char(out, '}');
         status->flags = TypeWasNotNative | CborTagType;
-        return CborNoError;
+        return err;
     }
 
     CborType type;
@@ -381,27 +583,18 @@ static CborError tagged_value_to_json(FILE *out, CborValue *it, int flags, Conve
     /* special handling of byte strings? */
     if (type == CborByteStringType && (flags & CborConvertByteStringsToBase64Url) == 0 &&
             (tag == CborNegativeBignumTag || tag == CborExpectedBase16Tag || tag == CborExpectedBase64Tag)) {
-        char *str;
-        const char *pre = "";
-
-        if (tag == CborNegativeBignumTag) {
-            pre = "~";
-            err = dump_bytestring_base64url(&str, it);
-        } else if (tag == CborExpectedBase64Tag) {
-            err = dump_bytestring_base64(&str, it);
-        } else { /* tag == CborExpectedBase16Tag */
-            err = dump_bytestring_base16(&str, it);
-        }
-        if (err)
-            return err;
-        err = fprintf(out, "\"%s%s\"", pre, str) < 0 ? CborErrorIO : CborNoError;
-        free(str);
+        if (tag == CborNegativeBignumTag)
+            err = byte_string_to_json(out, it, "~", base64url_alphabet);
+        else if (tag == CborExpectedBase64Tag)
+            err = byte_string_to_json(out, it, "", base64_alphabet);
+        else /* tag == CborExpectedBase16Tag */
+            err = byte_string_to_json(out, it, "", NULL);
         status->flags = TypeWasNotNative | TypeWasTagged | CborByteStringType;
         return err;
     }
 
     /* no special handling */
-    err = value_to_json(out, it, flags, type, status);
+    err = value_to_json(out, it, flags, type, status, recursionLeft - 1);
     status->flags |= TypeWasTagged | type;
     return err;
 }
@@ -428,64 +621,83 @@ static CborError stringify_map_key(char **key, CborValue *it, int flags, CborTyp
 #endif
 }
 
-static CborError array_to_json(FILE *out, CborValue *it, int flags, ConversionStatus *status)
+static CborError array_to_json(const CborJsonStream *out, CborValue *it, int flags, ConversionStatus *status,
+                               int recursionLeft)
 {
     const char *comma = "";
     while (!cbor_value_at_end(it)) {
-        if (fprintf(out, "%s", comma) < 0)
-            return CborErrorIO;
+        CborError err = put_str(out, comma);
+        if (err)
+            return err;
         comma = ",";
 
-        CborError err = value_to_json(out, it, flags, cbor_value_get_type(it), status);
+        err = value_to_json(out, it, flags, cbor_value_get_type(it), status, recursionLeft);
         if (err)
             return err;
     }
     return CborNoError;
 }
 
-static CborError map_to_json(FILE *out, CborValue *it, int flags, ConversionStatus *status)
+static CborError map_to_json(const CborJsonStream *out, CborValue *it, int flags, ConversionStatus *status,
+                             int recursionLeft)
 {
     const char *comma = "";
     CborError err;
     while (!cbor_value_at_end(it)) {
-        char *key;
-        if (fprintf(out, "%s", comma) < 0)
-            return CborErrorIO;
+        /* the key is only kept when the metadata that follows the value repeats it */
+        char *key = NULL;
+        size_t keyLen = 0;
+        err = put_str(out, comma);
+        if (err)
+            return err;
         comma = ",";
 
         CborType keyType = cbor_value_get_type(it);
         if (likely(keyType == CborTextStringType)) {
-            size_t n = 0;
-            err = cbor_value_dup_text_string(it, &key, &n, it);
+            if (flags & CborConvertAddMetadata)
+                err = cbor_value_dup_text_string(it, &key, &keyLen, NULL);
+            if (!err)
+                err = text_string_to_json(out, it);
         } else if (flags & CborConvertStringifyMapKeys) {
             err = stringify_map_key(&key, it, flags, keyType);
+            if (!err) {
+                keyLen = strlen(key);
+                err = put_char(out, '"');
+                if (!err)
+                    err = put_escaped(out, (const uint8_t *)key, keyLen);
+                if (!err)
+                    err = put_char(out, '"');
+            }
         } else {
             return CborErrorJsonObjectKeyNotString;
         }
-        if (err)
-            return err;
-
-        /* first, print the key */
-        if (fprintf(out, "\"%s\":", key) < 0) {
-            free(key);
-            return CborErrorIO;
-        }
+        if (!err)
+            err = put_char(out, ':');
 
         /* then, print the value */
         CborType valueType = cbor_value_get_type(it);
-        err = value_to_json(out, it, flags, valueType, status);
+        if (!err)
+            err = value_to_json(out, it, flags, valueType, status, recursionLeft);
 
         /* finally, print any metadata we may have */
         if (flags & CborConvertAddMetadata) {
             if (!err && keyType != CborTextStringType) {
-                if (fprintf(out, ",\"%s$keycbordump\":true", key) < 0)
-                    err = CborErrorIO;
+                err = put_str(out, ",\"");
+                if (!err)
+                    err = put_escaped(out, (const uint8_t *)key, keyLen);
+                if (!err)
+                    err = put_str(out, "$keycbordump\":true");
             }
             if (!err && status->flags) {
-                if (fprintf(out, ",\"%s$cbor\":{", key) < 0 ||
-                        add_value_metadata(out, valueType, status) != CborNoError ||
-                        fputc('}', out) < 0)
-                    err = CborErrorIO;
+                err = put_str(out, ",\"");
+                if (!err)
+                    err = put_escaped(out, (const uint8_t *)key, keyLen);
+                if (!err)
+                    err = put_str(out, "$cbor\":{");
+                if (!err)
+                    err = add_value_metadata(out, valueType, status);
+                if (!err)
+                    err = put_char(out, '}');
             }
         }
 
@@ -496,14 +708,50 @@ static CborError map_to_json(FILE *out, CborValue *it, int flags, ConversionStat
     return CborNoError;
 }
 
-static CborError value_to_json(FILE *out, CborValue *it, int flags, CborType type, ConversionStatus *status)
+#ifndef CBOR_NO_FLOATING_POINT
+static CborError double_to_json(const CborJsonStream *out, double val, ConversionStatus *status)
 {
-    CborError err;
+    /* without depending on libm: only NaN differs from itself, and infinities
+     * are the other values whose difference with themselves isn't zero */
+    double absolute = val < 0 ? -val : val;
+    char buf[32];
+    size_t len;
+
+    if (val != val || val - val != 0) {
+        status->flags |= val != val ? NumberWasNaN : NumberWasInfinite | (val < 0 ? NumberWasNegative : 0);
+        return put_str(out, "null");
+    }
+
+    if (absolute < 18446744073709551616.0 && (double)(uint64_t)absolute == absolute) {
+        /* print as integer so we get the full precision */
+        status->flags |= TypeWasNotNative;   /* mark this integer number as a double */
+        if (val < 0 && put_char(out, '-'))
+            return CborErrorIO;
+        return put_uint(out, (uint64_t)absolute, 10);
+    }
+
+    /* this number is definitely not a 64-bit integer */
+    if (!out->formatDouble)
+        return CborErrorJsonNotImplemented;
+    len = out->formatDouble(buf, sizeof(buf), val);
+    if (!len)
+        return CborErrorIO;
+    return put(out, buf, len);
+}
+#endif
+
+static CborError value_to_json(const CborJsonStream *out, CborValue *it, int flags, CborType type,
+                               ConversionStatus *status, int recursionLeft)
+{
+    CborError err = CborNoError;
     status->flags = 0;
 
-    switch (type) {
-    case CborArrayType:
-    case CborMapType: {
+    if (!recursionLeft)
+        return CborErrorNestingTooDeep;
+
+    /* an if chain rather than a switch, which armv6m would compile to a case
+     * table that native modules can't relocate */
+    if (type == CborArrayType || type == CborMapType) {
         /* recursive type */
         CborValue recursed;
         err = cbor_value_enter_container(it, &recursed);
@@ -511,18 +759,18 @@ static CborError value_to_json(FILE *out, CborValue *it, int flags, CborType typ
             copy_current_position(it, &recursed);
             return err;       /* parse error */
         }
-        if (fputc(type == CborArrayType ? '[' : '{', out) < 0)
+        if (put_char(out, type == CborArrayType ? '[' : '{'))
             return CborErrorIO;
 
         err = (type == CborArrayType) ?
-                  array_to_json(out, &recursed, flags, status) :
-                  map_to_json(out, &recursed, flags, status);
+                  array_to_json(out, &recursed, flags, status, recursionLeft - 1) :
+                  map_to_json(out, &recursed, flags, status, recursionLeft - 1);
         if (err) {
             copy_current_position(it, &recursed);
             return err;       /* parse error */
         }
 
-        if (fputc(type == CborArrayType ? ']' : '}', out) < 0)
+        if (put_char(out, type == CborArrayType ? ']' : '}'))
             return CborErrorIO;
         err = cbor_value_leave_container(it, &recursed);
         if (err)
@@ -532,136 +780,82 @@ static CborError value_to_json(FILE *out, CborValue *it, int flags, CborType typ
         return CborNoError;
     }
 
-    case CborIntegerType: {
-        double num;     /* JS numbers are IEEE double precision */
+    if (type == CborIntegerType) {
+        /* JS numbers are IEEE double precision, so JSON readers may lose
+         * precision on what is written exactly here */
         uint64_t val;
         cbor_value_get_raw_integer(it, &val);    /* can't fail */
-        num = (double)val;
 
         if (cbor_value_is_negative_integer(it)) {
-            num = -num - 1;                     /* convert to negative */
+            double num = -(double)val - 1;
             if ((uint64_t)(-num - 1) != val) {
                 status->flags = NumberPrecisionWasLost | NumberWasNegative;
                 status->originalNumber = val;
             }
+            err = put_negative(out, val);
         } else {
-            if ((uint64_t)num != val) {
+            if ((uint64_t)(double)val != val) {
                 status->flags = NumberPrecisionWasLost;
                 status->originalNumber = val;
             }
+            err = put_uint(out, val, 10);
         }
-        if (fprintf(out, "%.0f", num) < 0)  /* this number has no fraction, so no decimal points please */
-            return CborErrorIO;
-        break;
-    }
-
-    case CborByteStringType:
-    case CborTextStringType: {
-        char *str;
-        if (type == CborByteStringType) {
-            err = dump_bytestring_base64url(&str, it);
-            status->flags = TypeWasNotNative;
-        } else {
-            size_t n = 0;
-            err = cbor_value_dup_text_string(it, &str, &n, it);
-        }
-        if (err)
-            return err;
-        err = (fprintf(out, "\"%s\"", str) < 0) ? CborErrorIO : CborNoError;
-        free(str);
-        return err;
-    }
-
-    case CborTagType:
-        return tagged_value_to_json(out, it, flags, status);
-
-    case CborSimpleType: {
+    } else if (type == CborByteStringType) {
+        status->flags = TypeWasNotNative;
+        return byte_string_to_json(out, it, "", base64url_alphabet);
+    } else if (type == CborTextStringType) {
+        return text_string_to_json(out, it);
+    } else if (type == CborTagType) {
+        return tagged_value_to_json(out, it, flags, status, recursionLeft);
+    } else if (type == CborSimpleType) {
         uint8_t simple_type;
         cbor_value_get_simple_type(it, &simple_type);  /* can't fail */
         status->flags = TypeWasNotNative;
         status->originalNumber = simple_type;
-        if (fprintf(out, "\"simple(%" PRIu8 ")\"", simple_type) < 0)
-            return CborErrorIO;
-        break;
-    }
-
-    case CborNullType:
-        if (fprintf(out, "null") < 0)
-            return CborErrorIO;
-        break;
-
-    case CborUndefinedType:
+        err = put_str(out, "\"simple(");
+        if (!err)
+            err = put_uint(out, simple_type, 10);
+        if (!err)
+            err = put_str(out, ")\"");
+    } else if (type == CborNullType) {
+        err = put_str(out, "null");
+    } else if (type == CborUndefinedType) {
         status->flags = TypeWasNotNative;
-        if (fprintf(out, "\"undefined\"") < 0)
-            return CborErrorIO;
-        break;
-
-    case CborBooleanType: {
+        err = put_str(out, "\"undefined\"");
+    } else if (type == CborBooleanType) {
         bool val;
         cbor_value_get_boolean(it, &val);       /* can't fail */
-        if (fprintf(out, val ? "true" : "false") < 0)
-            return CborErrorIO;
-        break;
-    }
-
+        err = put_str(out, val ? "true" : "false");
+    } else if (type == CborDoubleType || type == CborFloatType || type == CborHalfFloatType) {
 #ifndef CBOR_NO_FLOATING_POINT
-    case CborDoubleType: {
         double val;
-        if (false) {
+        if (type == CborFloatType) {
             float f;
-    case CborFloatType:
             status->flags = TypeWasNotNative;
             cbor_value_get_float(it, &f);
             val = f;
-        } else if (false) {
-            uint16_t f16;
-    case CborHalfFloatType:
+        } else if (type == CborHalfFloatType) {
 #  ifndef CBOR_NO_HALF_FLOAT_TYPE
+            uint16_t f16;
             status->flags = TypeWasNotNative;
             cbor_value_get_half_float(it, &f16);
             val = decode_half(f16);
 #  else
-            (void)f16;
-            err = CborErrorUnsupportedType;
-            break;
+            return CborErrorUnsupportedType;
 #  endif
         } else {
             cbor_value_get_double(it, &val);
         }
-
-        int r = fpclassify(val);
-        if (r == FP_NAN || r == FP_INFINITE) {
-            if (fprintf(out, "null") < 0)
-                return CborErrorIO;
-            status->flags |= r == FP_NAN ? NumberWasNaN :
-                                           NumberWasInfinite | (val < 0 ? NumberWasNegative : 0);
-        } else {
-            uint64_t ival = (uint64_t)fabs(val);
-            if ((double)ival == fabs(val)) {
-                /* print as integer so we get the full precision */
-                r = fprintf(out, "%s%" PRIu64, val < 0 ? "-" : "", ival);
-                status->flags |= TypeWasNotNative;   /* mark this integer number as a double */
-            } else {
-                /* this number is definitely not a 64-bit integer */
-                r = fprintf(out, "%." DBL_DECIMAL_DIG_STR "g", val);
-            }
-            if (r < 0)
-                return CborErrorIO;
-        }
-        break;
-    }
+        err = double_to_json(out, val, status);
 #else
-    case CborDoubleType:
-    case CborFloatType:
-    case CborHalfFloatType:
-        err = CborErrorUnsupportedType;
-        break;
+        return CborErrorUnsupportedType;
 #endif /* !CBOR_NO_FLOATING_POINT */
-
-    case CborInvalidType:
+    } else {
         return CborErrorUnknownType;
     }
 
+    if (err)
+        return err;
     return cbor_value_advance_fixed(it);
 }
 
@@ -680,30 +874,35 @@ static CborError value_to_json(FILE *out, CborValue *it, int flags, CborType typ
  */
 
 /**
- * \fn CborError cbor_value_to_json(FILE *out, const CborValue *value, int flags)
+ * \struct CborJsonStream
+ * Destination of the JSON text produced by cbor_value_to_json_stream().
  *
- * Converts the current CBOR type pointed to by \a value to JSON and writes that
- * to the \a out stream. If an error occurs, this function returns an error
- * code similar to CborParsing. The \a flags parameter indicates one or more of
- * the flags from CborToJsonFlags that control the conversion.
- *
- * \sa cbor_value_to_json_advance(), cbor_value_to_pretty()
+ * \a write is called with \a token and the text in pieces, in order, and
+ * returns CborNoError or an error that stops the conversion. \a formatDouble
+ * writes a finite double that isn't an integer to a buffer in a form that
+ * reads back to the same value and returns its length, or zero if the buffer
+ * is too small. It may be null if such numbers can't be formatted,
+ * in which case converting one fails with CborErrorJsonNotImplemented.
  */
 
 /**
  * Converts the current CBOR type pointed to by \a value to JSON and writes that
- * to the \a out stream. If an error occurs, this function returns an error
- * code similar to CborParsing. The \a flags parameter indicates one or more of
- * the flags from CborToJsonFlags that control the conversion.
+ * to \a stream. If an error occurs, this function returns an error code
+ * similar to CborParsing. The \a flags parameter indicates one or more of the
+ * flags from CborToJsonFlags that control the conversion.
+ *
+ * This function doesn't depend on the C standard I/O library. Unless
+ * WITHOUT_OPEN_MEMSTREAM is defined, the CborConvertStringifyMapKeys flag
+ * does, through open_memstream().
  *
  * If no error ocurred, this function advances \a value to the next element.
  *
- * \sa cbor_value_to_json(), cbor_value_to_pretty_advance()
+ * \sa cbor_value_to_json_advance(), cbor_value_to_pretty_stream()
  */
-CborError cbor_value_to_json_advance(FILE *out, CborValue *value, int flags)
+CborError cbor_value_to_json_stream(const CborJsonStream *stream, CborValue *value, int flags)
 {
     ConversionStatus status;
-    return value_to_json(out, value, flags, cbor_value_get_type(value), &status);
+    return value_to_json(stream, value, flags, cbor_value_get_type(value), &status, CBOR_PARSER_MAX_RECURSIONS);
 }
 
 /** @} */
@@ -0,0 +1,115 @@
+/****************************************************************************
+**
+** Copyright (C) 2017 Intel Corporation
+**
+** Permission is hereby granted, free of charge, to any person obtaining a copy
+** of this software and associated documentation files (the "Software"), to deal
+** in the Software without restriction, including without limitation the rights
+** to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+** copies of the Software, and to permit persons to whom the Software is
+** furnished to do so, subject to the following conditions:
+**
+** The above copyright notice and this permission notice shall be included in
+** all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+** IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+** FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+** AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+** LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+** OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+** THE SOFTWARE.
+**
+****************************************************************************/
+
+#include "cbor.h"
+#include "cborjson.h"
+#include "compilersupport_p.h"
+#include <stdio.h>
+#include <string.h>
+
+/* The converter writes many small pieces: a punctuation character, an escape
+ * sequence, a number. They are gathered here so that the stream is only called
+ * once per buffer, instead of paying for its locking once per piece. */
+#define JSON_STDIO_BUFFER_SIZE  4096
+
+typedef struct JsonFileSink {
+    FILE *out;
+    size_t used;
+    char buffer[JSON_STDIO_BUFFER_SIZE];
+} JsonFileSink;
+
+static CborError sink_flush(JsonFileSink *sink)
+{
+    size_t used = sink->used;
+    sink->used = 0;
+    return fwrite(sink->buffer, 1, used, sink->out) == used ? CborNoError : CborErrorIO;
+}
+
+static CborError sink_write(void *token, const char *data, size_t len)
+{
+    JsonFileSink *sink = (JsonFileSink *)token;
+    if (likely(len <= sizeof(sink->buffer) - sink->used)) {
+        memcpy(sink->buffer + sink->used, data, len);
+        sink->used += len;
+        return CborNoError;
+    }
+
+    if (sink_flush(sink))
+        return CborErrorIO;
+    if (len >= sizeof(sink->buffer))
+        return fwrite(data, 1, len, sink->out) == len ? CborNoError : CborErrorIO;
+    memcpy(sink->buffer, data, len);
+    sink->used = len;
+    return CborNoError;
+}
+
+static size_t cbor_format_double(char *buffer, size_t size, double value)
+{
+    int n = snprintf(buffer, size, "%." DBL_DECIMAL_DIG_STR "g", value);
+    return n < 0 || (size_t)n >= size ? 0 : (size_t)n;
+}
+
+/**
+ * \fn CborError cbor_value_to_json(FILE *out, const CborValue *value, int flags)
+ *
+ * Converts the current CBOR type pointed to by \a value to JSON and writes that
+ * to the \a out stream. If an error occurs, this function returns an error
+ * code similar to CborParsing. The \a flags parameter indicates one or more of
+ * the flags from CborToJsonFlags that control the conversion.
+ *
+ * \sa cbor_value_to_json_advance(), cbor_value_to_pretty()
+ */
+
+/**
+ * Converts the current CBOR type pointed to by \a value to JSON and writes that
+ * to the \a out stream. If an error occurs, this function returns an error
+ * code similar to CborParsing. The \a flags parameter indicates one or more of
+ * the flags from CborToJsonFlags that control the conversion.
+ *
+ * The text is gathered in a buffer on the stack and written to \a out in
+ * blocks. Everything converted has been written when this function returns,
+ * including when it returns an error.
+ *
+ * If no error ocurred, this function advances \a value to the next element.
+ *
+ * \sa cbor_value_to_json(), cbor_value_to_json_stream(), cbor_value_to_pretty_advance()
+ */
+CborError cbor_value_to_json_advance(FILE *out, CborValue *value, int flags)
+{
+    JsonFileSink sink;
+    CborJsonStream stream;
+    CborError err;
+
+    sink.out = out;
+    sink.used = 0;
+    stream.write = sink_write;
+    stream.formatDouble = cbor_format_double;
+    stream.token = &sink;
+    err = cbor_value_to_json_stream(&stream, value, flags);
+
+    /* what was converted before an error is still written out */
+    if (sink_flush(&sink) && !err)
+        err = CborErrorIO;
+    return err;
+}
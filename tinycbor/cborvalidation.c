@@ -33,6 +33,7 @@
 #include "compilersupport_p.h"
 #include "utf8_p.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef CBOR_NO_FLOATING_POINT
@@ -45,6 +46,10 @@
 #  define CBOR_PARSER_MAX_RECURSIONS 1024
 #endif
 
+#ifndef CBOR_VALIDATION_MIN_KEY_TABLE
+#  define CBOR_VALIDATION_MIN_KEY_TABLE 16   /* must be a power of two */
+#endif
+
 /**
  * \addtogroup CborParsing
  * @{
@@ -81,6 +86,8 @@
  * \value CborValidateUtf8                  (Strict mode) Validate that text strings are appropriately
  *                                          encoded in UTF-8.
  * \value CborValidateMapKeysAreString      Validate that all map keys are text strings.
+ * \value CborValidateMapKeysAreDistinct    Validate that map keys are unique, without requiring them to be
+ *                                          sorted. Keys are compared by their encoded bytes.
  * \value CborValidateNoUndefined           Validate that no elements of type "undefined" are present.
  * \value CborValidateNoTags                Validate that no tags are used.
  * \value CborValidateFiniteFloatingPoint   Validate that all floating point numbers are finite (no NaN or
@@ -271,10 +278,19 @@ static inline CborError validate_utf8_string(const void *ptr, size_t n)
 {
     const uint8_t *buffer = (const uint8_t *)ptr;
     const uint8_t * const end = buffer + n;
+
+    /* most text is ASCII, so skip whole words or vectors of it before decoding */
+    buffer = skip_ascii(buffer, end);
+#ifdef CBOR_UTF8_SSSE3
+    if (end - buffer >= 16)
+        return validate_utf8_vector(buffer, (size_t)(end - buffer)) ? CborNoError : CborErrorInvalidUtf8TextString;
+#endif
+
     while (buffer < end) {
         uint32_t uc = get_utf8(&buffer, end);
         if (uc == ~0U)
             return CborErrorInvalidUtf8TextString;
+        buffer = skip_ascii(buffer, end);
     }
     return CborNoError;
 }
@@ -435,11 +451,94 @@ static inline CborError validate_floating_point(CborValue *it, CborType type, ui
 }
 #endif
 
+typedef struct KeySpan
+{
+    const uint8_t *ptr;
+    size_t len;
+    uint32_t hash;
+} KeySpan;
+
+typedef struct KeyTable
+{
+    KeySpan *spans;
+    size_t mask;
+    size_t count;
+} KeyTable;
+
+static void key_table_put(KeyTable *table, const KeySpan *span)
+{
+    size_t i = span->hash & table->mask;
+    while (table->spans[i].ptr)
+        i = (i + 1) & table->mask;
+    table->spans[i] = *span;
+    ++table->count;
+}
+
+static CborError key_table_grow(KeyTable *table, size_t size)
+{
+    KeyTable grown;
+    size_t i;
+
+    grown.spans = (KeySpan *)malloc(size * sizeof(KeySpan));
+    if (!grown.spans)
+        return CborErrorOutOfMemory;
+    memset(grown.spans, 0, size * sizeof(KeySpan));
+    grown.mask = size - 1;
+    grown.count = 0;
+
+    for (i = 0; table->spans && i <= table->mask; ++i) {
+        if (table->spans[i].ptr)
+            key_table_put(&grown, &table->spans[i]);
+    }
+    free(table->spans);
+    *table = grown;
+    return CborNoError;
+}
+
+/* Open addressing over the encoded key spans, kept at most half full. The
+ * table is sized from the map length when it's known, so only maps of
+ * indeterminate length ever rehash. */
+static CborError key_table_insert(KeyTable *table, const CborValue *it, const uint8_t *ptr, size_t len)
+{
+    KeySpan span;
+    size_t i;
+
+    if (!table->spans || (table->count + 1) * 2 > table->mask + 1) {
+        size_t size = CBOR_VALIDATION_MIN_KEY_TABLE;
+        size_t wanted = table->count + 1;
+        CborError err;
+
+        /* remaining counts the keys and values left after the current key */
+        if (it->remaining != UINT32_MAX)
+            wanted += it->remaining / 2;
+        while (size < wanted * 2)
+            size *= 2;
+        err = key_table_grow(table, size);
+        if (err)
+            return err;
+    }
+
+    span.ptr = ptr;
+    span.len = len;
+    span.hash = cbor_hash_bytes(ptr, len);
+    for (i = span.hash & table->mask; table->spans[i].ptr; i = (i + 1) & table->mask) {
+        if (table->spans[i].hash == span.hash && table->spans[i].len == len &&
+                memcmp(table->spans[i].ptr, ptr, len) == 0)
+            return CborErrorMapKeysNotUnique;
+    }
+    table->spans[i] = span;
+    ++table->count;
+    return CborNoError;
+}
+
 static CborError validate_container(CborValue *it, int containerType, uint32_t flags, int recursionLeft)
 {
-    CborError err;
+    CborError err = CborNoError;
     const uint8_t *previous = NULL;
     const uint8_t *previous_end = NULL;
+    KeyTable keys = { NULL, 0, 0 };
+    bool hashKeys = containerType == CborMapType && (flags & CborValidateMapKeysAreDistinct) &&
+            (flags & CborValidateMapIsSorted) != CborValidateMapIsSorted;
 
     if (!recursionLeft)
         return CborErrorNestingTooDeep;
@@ -455,24 +554,32 @@ static CborError validate_container(CborValue *it, int containerType, uint32_t f
                     CborValue copy = *it;
                     err = cbor_value_skip_tag(&copy);
                     if (err)
-                        return err;
+                        break;
                     type = cbor_value_get_type(&copy);
                 }
-                if (type != CborTextStringType)
-                    return CborErrorMapKeyNotString;
+                if (type != CborTextStringType) {
+                    err = CborErrorMapKeyNotString;
+                    break;
+                }
             }
         }
 
         err = validate_value(it, flags, recursionLeft);
         if (err)
-            return err;
+            break;
 
         if (containerType != CborMapType)
             continue;
 
-        if (flags & CborValidateMapIsSorted) {
-            if (it->parser->flags & CborParserFlag_ExternalSource)
-                return CborErrorUnimplementedValidation;
+        if ((flags & CborValidateMapIsSorted) == CborValidateMapIsSorted || hashKeys) {
+            /* both checks compare the keys' encoded bytes in place */
+            if (is_external_source(it->parser)) {
+                err = CborErrorUnimplementedValidation;
+                break;
+            }
+        }
+
+        if ((flags & CborValidateMapIsSorted) == CborValidateMapIsSorted) {
             if (previous) {
                 size_t bytelen1 = (size_t)(previous_end - previous);
                 size_t bytelen2 = (size_t)(cbor_value_get_next_byte(it) - current);
@@ -480,22 +587,34 @@ static CborError validate_container(CborValue *it, int containerType, uint32_t f
 
                 if (r == 0 && bytelen1 != bytelen2)
                     r = bytelen1 < bytelen2 ? -1 : +1;
-                if (r > 0)
-                    return CborErrorMapNotSorted;
-                if (r == 0 && (flags & CborValidateMapKeysAreUnique) == CborValidateMapKeysAreUnique)
-                    return CborErrorMapKeysNotUnique;
+                if (r > 0) {
+                    err = CborErrorMapNotSorted;
+                    break;
+                }
+                if (r == 0 && (flags & CborValidateMapKeysAreUnique) == CborValidateMapKeysAreUnique) {
+                    err = CborErrorMapKeysNotUnique;
+                    break;
+                }
             }
 
             previous = current;
             previous_end = cbor_value_get_next_byte(it);
         }
 
+        if (hashKeys) {
+            err = key_table_insert(&keys, it, current, (size_t)(cbor_value_get_next_byte(it) - current));
+            if (err)
+                break;
+        }
+
         /* map: that was the key, so get the value */
         err = validate_value(it, flags, recursionLeft);
         if (err)
-            return err;
+            break;
     }
-    return CborNoError;
+
+    free(keys.spans);
+    return err;
 }
 
 static CborError validate_value(CborValue *it, uint32_t flags, int recursionLeft)
@@ -512,9 +631,7 @@ static CborError validate_value(CborValue *it, uint32_t flags, int recursionLeft
             return CborErrorUnknownLength;
     }
 
-    switch (type) {
-    case CborArrayType:
-    case CborMapType: {
+    if (type == CborArrayType || type == CborMapType) {
         /* recursive type */
         CborValue recursed;
         err = cbor_value_enter_container(it, &recursed);
@@ -528,18 +645,11 @@ static CborError validate_value(CborValue *it, uint32_t flags, int recursionLeft
         if (err)
             return err;
         return CborNoError;
-    }
-
-    case CborIntegerType: {
+    } else if (type == CborIntegerType) {
         uint64_t val;
         err = cbor_value_get_raw_integer(it, &val);
         cbor_assert(err == CborNoError);         /* can't fail */
-
-        break;
-    }
-
-    case CborByteStringType:
-    case CborTextStringType: {
+    } else if (type == CborByteStringType || type == CborTextStringType) {
         size_t n = 0;
         const void *ptr;
 
@@ -570,9 +680,7 @@ static CborError validate_value(CborValue *it, uint32_t flags, int recursionLeft
         }
 
         return CborNoError;
-    }
-
-    case CborTagType: {
+    } else if (type == CborTagType) {
         CborTag tag;
         err = cbor_value_get_tag(it, &tag);
         cbor_assert(err == CborNoError);     /* can't fail */
@@ -585,41 +693,28 @@ static CborError validate_value(CborValue *it, uint32_t flags, int recursionLeft
             return err;
 
         return CborNoError;
-    }
-
-    case CborSimpleType: {
+    } else if (type == CborSimpleType) {
         uint8_t simple_type;
         err = cbor_value_get_simple_type(it, &simple_type);
         cbor_assert(err == CborNoError);     /* can't fail */
         err = validate_simple_type(simple_type, flags);
         if (err)
             return err;
-        break;
-    }
-
-    case CborNullType:
-    case CborBooleanType:
-        break;
-
-    case CborUndefinedType:
+    } else if (type == CborNullType || type == CborBooleanType) {
+        /* nothing to validate */
+    } else if (type == CborUndefinedType) {
         if (flags & CborValidateNoUndefined)
             return CborErrorExcludedType;
-        break;
-
-    case CborHalfFloatType:
-    case CborFloatType:
-    case CborDoubleType: {
+    } else if (type == CborHalfFloatType || type == CborFloatType || type == CborDoubleType) {
 #ifdef CBOR_NO_FLOATING_POINT
         return CborErrorUnsupportedType;
 #else
         err = validate_floating_point(it, type, flags);
         if (err)
             return err;
-        break;
 #endif /* !CBOR_NO_FLOATING_POINT */
-    }
-
-    case CborInvalidType:
+    } else {
+        /* CborInvalidType */
         return CborErrorUnknownType;
     }
 
@@ -647,11 +742,23 @@ CborError cbor_value_validate(const CborValue *it, uint32_t flags)
     CborError err = validate_value(&value, flags, CBOR_PARSER_MAX_RECURSIONS);
     if (err)
         return err;
-    if (flags & CborValidateCompleteData && can_read_bytes(it, 1))
+    if (flags & CborValidateCompleteData && can_read_bytes(&value, 1))
         return CborErrorGarbageAtEnd;
     return CborNoError;
 }
 
+/**
+ * Checks that the \a n bytes at \a ptr are valid UTF-8, the check
+ * CborValidateUtf8 applies to each text string, and returns
+ * CborErrorInvalidUtf8TextString if they aren't. This lets a decoder that
+ * already holds the contents of a string validate them without a second
+ * parse of the item.
+ */
+CborError cbor_validate_utf8(const void *ptr, size_t n)
+{
+    return validate_utf8_string(ptr, n);
+}
+
 /**
  * @}
  */
@@ -117,8 +117,6 @@
 #    define cbor_ntohs
 #    define cbor_htons
 #  endif
-#elif defined(__sun)
-#  include <sys/byteorder.h>
 #elif defined(_MSC_VER)
 /* MSVC, which implies Windows, which implies little-endian and sizeof(long) == 4 */
 #  include <stdlib.h>
@@ -129,41 +127,133 @@
 #  define cbor_ntohs        _byteswap_ushort
 #  define cbor_htons        _byteswap_ushort
 #endif
+/*
+ * Big-endian loads and stores at any alignment. Where the target can access
+ * unaligned words, memcpy compiles to a single load or store and is paired
+ * with a byte swap; elsewhere, armv6m among them, the value is assembled
+ * byte by byte so that no word access (or call to memcpy) is needed.
+ */
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64) || \
+    defined(__aarch64__) || defined(__ARM_FEATURE_UNALIGNED)
+#  define CBOR_UNALIGNED_ACCESS     1
+#endif
+
+#if defined(CBOR_UNALIGNED_ACCESS) && defined(cbor_ntohll) && defined(cbor_ntohl) && defined(cbor_ntohs)
+static inline uint16_t cbor_load_be16(const void *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return cbor_ntohs(v);
+}
+
+static inline uint32_t cbor_load_be32(const void *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return cbor_ntohl(v);
+}
+
+static inline uint64_t cbor_load_be64(const void *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return cbor_ntohll(v);
+}
+
+static inline void cbor_store_be16(void *p, uint16_t v)
+{
+    v = cbor_htons(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void cbor_store_be32(void *p, uint32_t v)
+{
+    v = cbor_htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void cbor_store_be64(void *p, uint64_t v)
+{
+    v = cbor_htonll(v);
+    memcpy(p, &v, sizeof(v));
+}
+#else
+static inline uint16_t cbor_load_be16(const void *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    return (uint16_t)((b[0] << 8) | b[1]);
+}
+
+static inline uint32_t cbor_load_be32(const void *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static inline uint64_t cbor_load_be64(const void *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    return ((uint64_t)cbor_load_be32(b) << 32) | cbor_load_be32(b + 4);
+}
+
+static inline void cbor_store_be16(void *p, uint16_t v)
+{
+    uint8_t *b = (uint8_t *)p;
+    b[0] = (uint8_t)(v >> 8);
+    b[1] = (uint8_t)v;
+}
+
+static inline void cbor_store_be32(void *p, uint32_t v)
+{
+    uint8_t *b = (uint8_t *)p;
+    b[0] = (uint8_t)(v >> 24);
+    b[1] = (uint8_t)(v >> 16);
+    b[2] = (uint8_t)(v >> 8);
+    b[3] = (uint8_t)v;
+}
+
+static inline void cbor_store_be64(void *p, uint64_t v)
+{
+    uint8_t *b = (uint8_t *)p;
+    cbor_store_be32(b, (uint32_t)(v >> 32));
+    cbor_store_be32(b + 4, (uint32_t)v);
+}
+#endif
+
 #ifndef cbor_ntohs
-#  include <arpa/inet.h>
-#  define cbor_ntohs        ntohs
-#  define cbor_htons        htons
-#endif
-#ifndef cbor_ntohl
-#  include <arpa/inet.h>
-#  define cbor_ntohl        ntohl
-#  define cbor_htonl        htonl
-#endif
-#ifndef cbor_ntohll
-#  define cbor_ntohll       ntohll
-#  define cbor_htonll       htonll
-/* ntohll isn't usually defined */
-#  ifndef ntohll
-#    if (defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__) || \
-    (defined(__BYTE_ORDER) && defined(__BIG_ENDIAN) && __BYTE_ORDER == __BIG_ENDIAN) || \
-    (defined(BYTE_ORDER) && defined(BIG_ENDIAN) && BYTE_ORDER == BIG_ENDIAN) || \
-    (defined(_BIG_ENDIAN) && !defined(_LITTLE_ENDIAN)) || (defined(__BIG_ENDIAN__) && !defined(__LITTLE_ENDIAN__)) || \
-    defined(__ARMEB__) || defined(__MIPSEB__) || defined(__s390__) || defined(__sparc__)
-#      define ntohll
-#      define htonll
-#    elif (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
-    (defined(__BYTE_ORDER) && defined(__LITTLE_ENDIAN) && __BYTE_ORDER == __LITTLE_ENDIAN) || \
-    (defined(BYTE_ORDER) && defined(LITTLE_ENDIAN) && BYTE_ORDER == LITTLE_ENDIAN) || \
-    defined(_LITTLE_ENDIAN) || defined(__LITTLE_ENDIAN__) || defined(__ARMEL__) || defined(__MIPSEL__) || \
-    defined(__i386) || defined(__i386__) || defined(__x86_64) || defined(__x86_64__) || defined(__amd64)
-#      define ntohll(x)       ((ntohl((uint32_t)(x)) * UINT64_C(0x100000000)) + (ntohl((x) >> 32)))
-#      define htonll          ntohll
-#    else
-#      error "Unable to determine byte order!"
-#    endif
-#  endif
+/* without byte swap builtins, going through memory works for either byte order */
+static inline uint16_t cbor_ntohs(uint16_t v) { return cbor_load_be16(&v); }
+static inline uint32_t cbor_ntohl(uint32_t v) { return cbor_load_be32(&v); }
+static inline uint64_t cbor_ntohll(uint64_t v) { return cbor_load_be64(&v); }
+#  define cbor_htons        cbor_ntohs
+#  define cbor_htonl        cbor_ntohl
+#  define cbor_htonll       cbor_ntohll
 #endif
 
+/*
+ * Returns 0, 1, 2 or 3 for a value that needs 1, 2, 4 or 8 bytes, the widths
+ * of the CBOR integer forms. Where the target counts leading zeros in one
+ * instruction, the width comes from the highest set bit without branching.
+ * armv6m has no such instruction, and __builtin_clzll would become a call to
+ * libgcc, which native modules don't link, so it compares the halves instead.
+ */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__) || defined(__aarch64__) || \
+    defined(__ARM_FEATURE_CLZ))
+static inline unsigned cbor_width_log2(uint64_t v)
+{
+    /* the number of bytes, 1 to 8, picks a 2-bit field of 0, 1, 2, 2, 3, 3, 3, 3 */
+    unsigned bytes = (64 - __builtin_clzll(v | 1) + 7) / 8;
+    return (0x3fe90U >> (2 * bytes)) & 3;
+}
+#else
+static inline unsigned cbor_width_log2(uint64_t v)
+{
+    uint32_t low = (uint32_t)v;
+    if (v >> 32)
+        return 3;
+    return low > 0xffffU ? 2 : low > 0xffU;
+}
+#endif
 
 #ifdef __cplusplus
 #  define CONST_CAST(t, v)  const_cast<t>(v)
@@ -1,14 +1,18 @@
 SOURCES += \
+    $$PWD/cborcompact.c \
     $$PWD/cborencoder.c \
     $$PWD/cborencoder_close_container_checked.c \
     $$PWD/cborencoder_float.c \
     $$PWD/cborerrorstrings.c \
+    $$PWD/cborfromjson.c \
     $$PWD/cborparser.c \
     $$PWD/cborparser_dup_string.c \
     $$PWD/cborparser_float.c \
     $$PWD/cborpretty.c \
     $$PWD/cborpretty_stdio.c \
+    $$PWD/cbortape.c \
     $$PWD/cbortojson.c \
+    $$PWD/cbortojson_stdio.c \
     $$PWD/cborvalidation.c \
 
 HEADERS += \
@@ -28,6 +28,22 @@
 #include "compilersupport_p.h"
 
 #include <stdint.h>
+#include <string.h>
+
+/* Vector code is picked at compile time; armv6m and other targets without
+ * SSE2 use word-at-a-time ASCII checks and the scalar decoder below.
+ * Define CBOR_NO_SIMD to force the portable code. */
+#ifndef CBOR_NO_SIMD
+#  if defined(__SSSE3__)
+#    include <tmmintrin.h>
+#    define CBOR_UTF8_SSSE3
+#  elif defined(__SSE2__)
+#    include <emmintrin.h>
+#  endif
+#  if defined(__AVX2__)
+#    include <immintrin.h>
+#  endif
+#endif
 
 static inline uint32_t get_utf8(const uint8_t **buffer, const uint8_t *end)
 {
@@ -101,4 +117,182 @@ static inline uint32_t get_utf8(const uint8_t **buffer, const uint8_t *end)
     return uc;
 }
 
+/* Returns the first non-ASCII byte in [ptr, end), or end. */
+static inline const uint8_t *skip_ascii(const uint8_t *ptr, const uint8_t *end)
+{
+#if !defined(CBOR_NO_SIMD) && defined(__AVX2__)
+    for ( ; end - ptr >= 32; ptr += 32) {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)ptr)))
+            break;
+    }
+#endif
+#if !defined(CBOR_NO_SIMD) && defined(__SSE2__)
+    for ( ; end - ptr >= 16; ptr += 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ptr)))
+            break;
+    }
+#else
+    const size_t highBits = (size_t)0x8080808080808080ULL;
+    size_t word;
+
+    /* SWAR: align first, as targets like armv6m can't load unaligned words */
+    while (ptr < end && ((uintptr_t)ptr & (sizeof(size_t) - 1))) {
+        if (*ptr >= 0x80)
+            return ptr;
+        ++ptr;
+    }
+    for ( ; (size_t)(end - ptr) >= sizeof(size_t); ptr += sizeof(size_t)) {
+#  ifdef __GNUC__
+        memcpy(&word, __builtin_assume_aligned(ptr, sizeof(size_t)), sizeof(word));
+#  else
+        memcpy(&word, ptr, sizeof(word));
+#  endif
+        if (word & highBits)
+            break;
+    }
+#endif
+
+    while (ptr < end && *ptr < 0x80)
+        ++ptr;
+    return ptr;
+}
+
+#ifdef CBOR_UTF8_SSSE3
+/* Validates 16 bytes per step with the lookup-table algorithm by Keiser and
+ * Lemire ("Validating UTF-8 In Less Than One Instruction Per Byte", 2021):
+ * the high nibbles of each byte and its predecessor and the low nibble of the
+ * predecessor index three tables whose AND is non-zero exactly for the invalid
+ * two-byte combinations. Three and four byte sequences are finished by
+ * checking that the bytes 2 and 3 positions after a lead are continuations. */
+typedef __m128i Utf8Vector;
+#  define utf8_load(p)                _mm_loadu_si128((const __m128i *)(const void *)(p))
+#  define utf8_splat(c)               _mm_set1_epi8((char)(c))
+#  define utf8_and(a, b)              _mm_and_si128(a, b)
+#  define utf8_or(a, b)               _mm_or_si128(a, b)
+#  define utf8_xor(a, b)              _mm_xor_si128(a, b)
+#  define utf8_subs(a, b)             _mm_subs_epu8(a, b)
+#  define utf8_lookup(table, idx)     _mm_shuffle_epi8(table, idx)
+#  define utf8_high_nibbles(v)        _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f))
+#  define utf8_prev(v, prev, n)       _mm_alignr_epi8(v, prev, 16 - (n))
+#  define utf8_is_ascii(v)            (_mm_movemask_epi8(v) == 0)
+#  define utf8_is_zero(v)             (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff)
+
+enum {
+    Utf8TooShort        = 1 << 0,   /* lead byte not followed by a continuation */
+    Utf8TooLong         = 1 << 1,   /* continuation after ASCII */
+    Utf8Overlong3       = 1 << 2,
+    Utf8TooLarge        = 1 << 3,   /* above U+10FFFF */
+    Utf8Surrogate       = 1 << 4,
+    Utf8Overlong2       = 1 << 5,
+    Utf8TooLarge1000    = 1 << 6,
+    Utf8Overlong4       = 1 << 6,
+    Utf8TwoConts        = 1 << 7,   /* continuation after continuation: only valid in 3 and 4 byte sequences */
+    Utf8Carry           = Utf8TooShort | Utf8TooLong | Utf8TwoConts
+};
+
+static const uint8_t utf8_byte1_high[16] = {
+    /* 0xxx: ASCII */
+    Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong,
+    Utf8TooLong, Utf8TooLong, Utf8TooLong, Utf8TooLong,
+    /* 10xx: continuation */
+    Utf8TwoConts, Utf8TwoConts, Utf8TwoConts, Utf8TwoConts,
+    /* 1100, 1101: two-byte lead */
+    Utf8TooShort | Utf8Overlong2,
+    Utf8TooShort,
+    /* 1110: three-byte lead */
+    Utf8TooShort | Utf8Overlong3 | Utf8Surrogate,
+    /* 1111: four-byte lead */
+    Utf8TooShort | Utf8TooLarge | Utf8TooLarge1000 | Utf8Overlong4
+};
+
+static const uint8_t utf8_byte1_low[16] = {
+    Utf8Carry | Utf8Overlong3 | Utf8Overlong2 | Utf8Overlong4,
+    Utf8Carry | Utf8Overlong2,
+    Utf8Carry,
+    Utf8Carry,
+    Utf8Carry | Utf8TooLarge,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000 | Utf8Surrogate,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000,
+    Utf8Carry | Utf8TooLarge | Utf8TooLarge1000
+};
+
+static const uint8_t utf8_byte2_high[16] = {
+    /* xxxx 0xxx: ASCII */
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort,
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort,
+    /* xxxx 1000 */
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Overlong3 | Utf8TooLarge1000 | Utf8Overlong4,
+    /* xxxx 1001 */
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Overlong3 | Utf8TooLarge,
+    /* xxxx 101x */
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Surrogate | Utf8TooLarge,
+    Utf8TooLong | Utf8Overlong2 | Utf8TwoConts | Utf8Surrogate | Utf8TooLarge,
+    /* xxxx 11xx: lead */
+    Utf8TooShort, Utf8TooShort, Utf8TooShort, Utf8TooShort
+};
+
+/* subtracting these leaves a non-zero byte where the block ends inside a sequence */
+static const uint8_t utf8_incomplete_max[16] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+};
+
+static inline Utf8Vector utf8_block_errors(Utf8Vector input, Utf8Vector prevInput)
+{
+    Utf8Vector prev1 = utf8_prev(input, prevInput, 1);
+    Utf8Vector special =
+            utf8_and(utf8_and(utf8_lookup(utf8_load(utf8_byte1_high), utf8_high_nibbles(prev1)),
+                              utf8_lookup(utf8_load(utf8_byte1_low), utf8_and(prev1, utf8_splat(0x0f)))),
+                     utf8_lookup(utf8_load(utf8_byte2_high), utf8_high_nibbles(input)));
+
+    /* bytes 2 and 3 after a three or four-byte lead must be continuations */
+    Utf8Vector third = utf8_subs(utf8_prev(input, prevInput, 2), utf8_splat(0xe0 - 0x80));
+    Utf8Vector fourth = utf8_subs(utf8_prev(input, prevInput, 3), utf8_splat(0xf0 - 0x80));
+    Utf8Vector must23 = utf8_and(utf8_or(third, fourth), utf8_splat(0x80));
+    return utf8_xor(must23, special);
+}
+
+static inline bool validate_utf8_vector(const uint8_t *ptr, size_t n)
+{
+    const uint8_t * const end = ptr + n;
+    Utf8Vector prevInput = utf8_splat(0);
+    Utf8Vector prevIncomplete = utf8_splat(0);
+    Utf8Vector error = utf8_splat(0);
+    uint8_t tail[16];
+
+    while (ptr < end) {
+        Utf8Vector input;
+        if (end - ptr >= 16) {
+            input = utf8_load(ptr);
+            ptr += 16;
+        } else {
+            /* zero padding is ASCII, so a truncated sequence shows up as too short */
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, ptr, (size_t)(end - ptr));
+            input = utf8_load(tail);
+            ptr = end;
+        }
+
+        if (utf8_is_ascii(input)) {
+            error = utf8_or(error, prevIncomplete);
+            prevIncomplete = utf8_splat(0);
+        } else {
+            error = utf8_or(error, utf8_block_errors(input, prevInput));
+            prevIncomplete = utf8_subs(input, utf8_load(utf8_incomplete_max));
+        }
+        prevInput = input;
+    }
+    error = utf8_or(error, prevIncomplete);
+    return utf8_is_zero(error);
+}
+#endif
+
 #endif /* CBOR_UTF8_H */